@@ -0,0 +1,189 @@
+#pragma once
+#include <vector>
+#include <tuple>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <algorithm>
+#include <chrono>
+#include <typeinfo>
+#include <type_traits>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+//Hands out storage aligned to ALIGN bytes (a cache line by default)
+template <class T, size_t ALIGN = 64>
+struct aligned_allocator
+{
+	using value_type = T;
+	template <class U> struct rebind { using other = aligned_allocator<U, ALIGN>; };
+
+	aligned_allocator() = default;
+	template <class U>
+	aligned_allocator(const aligned_allocator<U, ALIGN>&) {}
+
+	T* allocate(size_t n)
+	{
+		void* p = ::operator new(n * sizeof(T), std::align_val_t(ALIGN));
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, size_t)
+	{
+		::operator delete(p, std::align_val_t(ALIGN));
+	}
+
+	template <class U>
+	bool operator==(const aligned_allocator<U, ALIGN>&) const { return true; }
+	template <class U>
+	bool operator!=(const aligned_allocator<U, ALIGN>&) const { return false; }
+};
+
+template <class T>
+using aligned_column = std::vector<T, aligned_allocator<T>>;
+
+///Calls of the same function gathered column-wise: one contiguous, cache
+///line aligned array per parameter. Scheduling it runs a batch kernel
+///
+///	void kernel(size_t count, Res* out, const Args*... in);
+///
+///over chunks of the columns (every pointer 64 byte aligned, count a
+///multiple of 64 except for the last chunk), so the loop can be vectorized.
+///A single future resolves to the whole output column.
+///
+///	ColumnBatch<float, float, float> batch;
+///	for (...) batch.append(a, b);
+///	auto out = std::move(batch).schedule(pool, [](size_t n, float* r, const float* a, const float* b)
+///		{ for (size_t x = 0; x < n; ++x) r[x] = a[x] * b[x]; });
+template <class Res, class... Args>
+class ColumnBatch
+{
+	static_assert(sizeof...(Args) != 0, "a batch needs at least one argument column");
+	static_assert(!std::is_void<Res>::value && std::is_default_constructible<Res>::value,
+		"the output column is allocated up front");
+
+public:
+	ColumnBatch() = default;
+	explicit ColumnBatch(size_t expected) { reserve(expected); }
+
+	void reserve(size_t count)
+	{
+		reserve_impl(count, std::index_sequence_for<Args...>{});
+	}
+
+	void append(Args... args)
+	{
+		append_impl(std::index_sequence_for<Args...>{}, std::move(args)...);
+	}
+
+	size_t size() const { return std::get<0>(m_columns).size(); }
+
+	template <size_t I>
+	const aligned_column<std::tuple_element_t<I, std::tuple<Args...>>>& column() const
+	{
+		return std::get<I>(m_columns);
+	}
+
+	//chunk: elements per task, 0 lets the batch pick (a few chunks per
+	//hardware thread, or chunks of about target_chunk_runtime once the
+	//executor tracks runtimes and has seen the kernel). Rounded up to keep
+	//every chunk aligned
+	template <class Kernel>
+	TaskFuture<aligned_column<Res>> schedule(Executor_base& executor, Kernel kernel,
+		size_t chunk = 0, Priority p = MEDIUM) &&
+	{
+		size_t count = size();
+		if (chunk == 0)
+			chunk = auto_chunk<Kernel>(executor, count);
+		chunk = std::max<size_t>((chunk + elements_per_chunk_step - 1) & ~(elements_per_chunk_step - 1),
+			elements_per_chunk_step);
+
+		size_t chunks = std::max<size_t>((count + chunk - 1) / chunk, 1);
+		auto state = std::make_shared<batch_state<Kernel>>(
+			std::move(m_columns), std::move(kernel), count, chunks);
+		if (executor.tracks_runtimes())
+			state->timing = &executor;
+
+		TaskFuture<aligned_column<Res>> future = state->promise.get_future();
+		future_state_access::state(future)->set_executor_base(&executor);
+
+		for (size_t first = 0, x = 0; x < chunks; ++x, first += chunk)
+		{
+			size_t n = std::min(chunk, count - std::min(first, count));
+			executor.schedule(make_packaged_task([state, first, n]
+			{
+				state->run(first, n, std::index_sequence_for<Args...>{});
+			}), p);
+		}
+
+		return future;
+	}
+
+private:
+	//64 elements of any type span a multiple of 64 bytes
+	static constexpr size_t elements_per_chunk_step = 64;
+
+	static constexpr std::chrono::microseconds target_chunk_runtime{ 50 };
+
+	template <class Kernel>
+	static size_t auto_chunk(const Executor_base& executor, size_t count)
+	{
+		size_t workers = std::max(1u, std::thread::hardware_concurrency());
+		auto step = executor.expected_loop_runtime(typeid(Kernel), elements_per_chunk_step);
+		if (step.count() == 0)
+			return count / (4 * workers);
+
+		//Never fewer chunks than workers
+		size_t steps = static_cast<size_t>(std::chrono::nanoseconds(target_chunk_runtime) / step);
+		return std::min(count / workers, std::max<size_t>(steps, 1) * elements_per_chunk_step);
+	}
+
+	template <class Kernel>
+	struct batch_state
+	{
+		batch_state(std::tuple<aligned_column<Args>...>&& columns, Kernel&& k,
+			size_t count, size_t chunks) :
+			in(std::move(columns)), out(count), kernel(std::move(k)), remaining(chunks) {}
+
+		template <size_t... I>
+		void run(size_t first, size_t n, std::index_sequence<I...>)
+		{
+			if (n != 0)
+			{
+				using clock = std::chrono::steady_clock;
+				auto start = timing != nullptr ? clock::now() : clock::time_point{};
+				kernel(n, out.data() + first, (std::get<I>(in).data() + first)...);
+				if (timing != nullptr)
+					timing->record_loop(typeid(Kernel), n, clock::now() - start);
+			}
+
+			//The last chunk hands the output over
+			if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				promise.set_value(std::move(out));
+		}
+
+		std::tuple<aligned_column<Args>...> in;
+		aligned_column<Res> out;
+		Kernel kernel;
+		std::atomic<size_t> remaining;
+		TaskPromise<aligned_column<Res>> promise;
+		Executor_base* timing = nullptr; //records the kernel's runtime
+	};
+
+	template <size_t... I>
+	void reserve_impl(size_t count, std::index_sequence<I...>)
+	{
+		(std::get<I>(m_columns).reserve(count), ...);
+	}
+
+	template <size_t... I>
+	void append_impl(std::index_sequence<I...>, Args&&... args)
+	{
+		(std::get<I>(m_columns).push_back(std::move(args)), ...);
+	}
+
+	std::tuple<aligned_column<Args>...> m_columns;
+};
@@ -0,0 +1,393 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <new>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+namespace impl
+{
+	//Minimal stackful context: a native one (the thread's own stack, only
+	//switched from/to) or a fiber with a stack of its own running entry(arg)
+#ifdef _WIN32
+	class fiber_context
+	{
+	public:
+		fiber_context() = default;
+		fiber_context(const fiber_context&) = delete;
+		fiber_context& operator= (const fiber_context&) = delete;
+
+		~fiber_context()
+		{
+			if (m_owned)
+				DeleteFiber(m_handle);
+		}
+
+		void init_native()
+		{
+			m_handle = ConvertThreadToFiber(nullptr);
+		}
+
+		//On the thread that called init_native
+		void exit_native()
+		{
+			ConvertFiberToThread();
+			m_handle = nullptr;
+		}
+
+		void create(size_t stack_size, void(*entry)(void*), void* arg)
+		{
+			m_entry = entry;
+			m_arg = arg;
+			m_handle = CreateFiber(stack_size, &fiber_context::trampoline, this);
+			if (m_handle == nullptr)
+				throw std::bad_alloc();
+			m_owned = true;
+		}
+
+		static void switch_to(fiber_context&, fiber_context& to)
+		{
+			SwitchToFiber(to.m_handle);
+		}
+
+	private:
+		static VOID CALLBACK trampoline(LPVOID self)
+		{
+			auto* ctx = static_cast<fiber_context*>(self);
+			ctx->m_entry(ctx->m_arg);
+		}
+
+		void* m_handle = nullptr;
+		bool m_owned = false;
+		void(*m_entry)(void*) = nullptr;
+		void* m_arg = nullptr;
+	};
+#else
+	class fiber_context
+	{
+	public:
+		fiber_context() = default;
+		fiber_context(const fiber_context&) = delete;
+		fiber_context& operator= (const fiber_context&) = delete;
+
+		~fiber_context()
+		{
+			if (m_stack != nullptr)
+				munmap(m_stack, m_stack_size);
+		}
+
+		//swapcontext saves the thread's registers into m_context
+		void init_native() {}
+		void exit_native() {}
+
+		void create(size_t stack_size, void(*entry)(void*), void* arg)
+		{
+			//Rounded to pages, plus a guard page below the stack
+			size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+			m_stack_size = (stack_size + page - 1) / page * page + page;
+
+			void* stack = mmap(nullptr, m_stack_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+			if (stack == MAP_FAILED)
+				throw std::bad_alloc();
+			m_stack = stack;
+			mprotect(m_stack, page, PROT_NONE);
+
+			m_entry = entry;
+			m_arg = arg;
+			getcontext(&m_context);
+			m_context.uc_stack.ss_sp = static_cast<char*>(m_stack) + page;
+			m_context.uc_stack.ss_size = m_stack_size - page;
+			m_context.uc_link = nullptr;
+			makecontext(&m_context, &fiber_context::trampoline, 0);
+		}
+
+		static void switch_to(fiber_context& from, fiber_context& to)
+		{
+			starting() = &to;
+			swapcontext(&from.m_context, &to.m_context);
+		}
+
+	private:
+		//makecontext only passes ints, hand the context over on the side
+		static fiber_context*& starting()
+		{
+			static thread_local fiber_context* ctx = nullptr;
+			return ctx;
+		}
+
+		static void trampoline()
+		{
+			fiber_context* ctx = starting();
+			ctx->m_entry(ctx->m_arg);
+		}
+
+		ucontext_t m_context;
+		void* m_stack = nullptr;
+		size_t m_stack_size = 0;
+		void(*m_entry)(void*) = nullptr;
+		void* m_arg = nullptr;
+	};
+#endif
+} // namespace impl
+
+///Runs tasks on pooled user-space stacks. A task that blocks in get()/wait()
+///on a future suspends its fiber instead of the OS thread, which goes on
+///with other queued tasks; the set_ready of the awaited state makes the
+///fiber runnable again. Thousands of logically blocked tasks multiplex onto
+///THREADS OS threads, with at most max_fibers stacks per thread.
+///
+///NOTE: a fiber resumes on the thread it blocked on. wait_for/wait_until
+///still block the thread. WorkerContext is not available (its arena is
+///reset between tasks, which blocked fibers would not survive).
+///Destroy the pool only when no task is blocked.
+template <size_t THREADS>
+class FiberExecutorPool : public Executor_base, private Executor_base::wake_listener
+{
+	using _Base = Executor_base;
+
+public:
+	explicit FiberExecutorPool(size_t stack_size = 256 * 1024, size_t max_fibers = 1024) :
+		m_stack_size(stack_size), m_max_fibers(max_fibers != 0 ? max_fibers : 1)
+	{
+		_Base::forward_wake_ups(this);
+
+		for (auto x = 0u; x < THREADS; ++x)
+			m_threads[x].pool = this;
+		for (auto x = 0u; x < THREADS; ++x)
+			m_workers[x] = std::thread(&FiberExecutorPool::run, this, std::ref(m_threads[x]));
+	}
+
+	~FiberExecutorPool()
+	{
+		m_alive = false;
+		for (auto&& t : m_threads)
+		{
+			std::lock_guard<std::mutex> lk(t.mutex);
+			t.cv.notify_one();
+		}
+
+		for (auto&& worker : m_workers)
+			worker.join();
+	}
+
+	FiberExecutorPool(const FiberExecutorPool&) = delete;
+	FiberExecutorPool& operator= (const FiberExecutorPool&) = delete;
+
+private:
+	struct fiber_thread;
+
+	struct fiber
+	{
+		impl::fiber_context context;
+		fiber_thread* home;
+	};
+
+	//Resumes a suspended fiber, queued as a continuation of what it waits for
+	class wake_fiber final : public Executable
+	{
+	public:
+		wake_fiber(fiber* f, Priority p) : Executable(p, typeid(wake_fiber)), m_fiber(f) {}
+		void execute() override { m_fiber->home->make_ready(m_fiber); }
+
+	private:
+		fiber* m_fiber;
+	};
+
+	struct fiber_thread final : fiber_hook
+	{
+		FiberExecutorPool* pool = nullptr;
+		impl::fiber_context native;
+		fiber* running = nullptr;
+
+		std::vector<std::unique_ptr<fiber>> fibers; //every stack of this thread
+		std::vector<fiber*> idle;                  //fibers not inside a task
+		bool ran_task = false;
+
+		//Set by suspend, acted upon once back on the native stack
+		const std::function<void(std::unique_ptr<Executable>)>* pending_wake = nullptr;
+		Priority pending_priority = MEDIUM;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<fiber*> ready; //woken up, waiting to be switched to
+		std::atomic<size_t> ready_count{ 0 };
+		bool sleeping = false;
+
+		void suspend(Priority p,
+			const std::function<void(std::unique_ptr<Executable>)>& add_wake) override
+		{
+			fiber* self = running;
+			Priority own = _Base::running_priority();
+
+			pending_wake = &add_wake;
+			pending_priority = p;
+			impl::fiber_context::switch_to(self->context, native);
+
+			//Resumed: the awaited state is ready. Other fibers ran meanwhile
+			_Base::running_priority() = own;
+		}
+
+		void make_ready(fiber* f)
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			ready.push_back(f);
+			ready_count.fetch_add(1, std::memory_order_release);
+			if (sleeping)
+				cv.notify_one();
+		}
+	};
+
+	static void fiber_main(void* arg)
+	{
+		fiber* self = static_cast<fiber*>(arg);
+		fiber_thread& t = *self->home;
+
+		//Runs queued tasks until there are none, or a woken fiber should get
+		//the thread back. Never returns: an idle fiber is simply reused
+		while (true)
+		{
+			while (t.ready_count.load(std::memory_order_acquire) == 0
+				&& t.pool->try_run_one())
+				t.ran_task = true;
+
+			impl::fiber_context::switch_to(self->context, t.native);
+		}
+	}
+
+	//Switches to f until it suspends or runs out of tasks. Returns false
+	//if it ran nothing at all
+	bool switch_into(fiber_thread& t, fiber* f)
+	{
+		t.running = f;
+		t.ran_task = false;
+
+		fiber_hook::current() = &t;
+		impl::fiber_context::switch_to(t.native, f->context);
+		fiber_hook::current() = nullptr;
+		t.running = nullptr;
+
+		if (t.pending_wake != nullptr)
+		{
+			//f is off its stack now, it is safe for anyone to wake it up
+			auto* add_wake = t.pending_wake;
+			t.pending_wake = nullptr;
+			(*add_wake)(std::make_unique<wake_fiber>(f, t.pending_priority));
+			return true;
+		}
+
+		t.idle.push_back(f);
+		return t.ran_task;
+	}
+
+	fiber* pop_ready(fiber_thread& t)
+	{
+		if (t.ready_count.load(std::memory_order_acquire) == 0)
+			return nullptr;
+
+		std::lock_guard<std::mutex> lk(t.mutex);
+		fiber* f = t.ready.front();
+		t.ready.pop_front();
+		t.ready_count.fetch_sub(1, std::memory_order_relaxed);
+		return f;
+	}
+
+	fiber* idle_fiber(fiber_thread& t)
+	{
+		if (!t.idle.empty())
+		{
+			fiber* f = t.idle.back();
+			t.idle.pop_back();
+			return f;
+		}
+
+		//Every stack is blocked in a wait: only woken fibers can go on
+		if (t.fibers.size() >= m_max_fibers)
+			return nullptr;
+
+		t.fibers.emplace_back(new fiber);
+		fiber* f = t.fibers.back().get();
+		f->home = &t;
+		f->context.create(m_stack_size, &FiberExecutorPool::fiber_main, f);
+		return f;
+	}
+
+	void run(fiber_thread& t)
+	{
+		t.native.init_native();
+
+		while (m_alive)
+		{
+			//Anything queued after this read bumps the epoch
+			auto epoch = m_epoch.load();
+
+			if (fiber* f = pop_ready(t))
+			{
+				switch_into(t, f);
+				continue;
+			}
+
+			if (fiber* f = idle_fiber(t))
+				if (switch_into(t, f))
+					continue;
+
+			m_sleepers.fetch_add(1);
+			{
+				std::unique_lock<std::mutex> lk(t.mutex);
+				if (m_alive && t.ready.empty() && epoch == m_epoch.load())
+				{
+					t.sleeping = true;
+					t.cv.wait(lk);
+					t.sleeping = false;
+				}
+			}
+			m_sleepers.fetch_sub(1);
+		}
+
+		t.native.exit_native();
+	}
+
+	void task_queued(bool many) override
+	{
+		m_epoch.fetch_add(1);
+		if (m_sleepers.load() == 0)
+			return;
+
+		for (auto&& t : m_threads)
+		{
+			std::lock_guard<std::mutex> lk(t.mutex);
+			if (t.sleeping)
+			{
+				t.cv.notify_one();
+				if (!many)
+					return;
+			}
+		}
+	}
+
+	const size_t m_stack_size;
+	const size_t m_max_fibers;
+
+	fiber_thread m_threads[THREADS];
+	std::thread m_workers[THREADS];
+
+	std::atomic<std::uint64_t> m_epoch{ 0 };
+	std::atomic<size_t> m_sleepers{ 0 };
+	std::atomic_bool m_alive{ true };
+};
@@ -0,0 +1,166 @@
+#pragma once
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+#include "Timer.h"
+
+///Marks fn as safe to run more than once concurrently, with only one of
+///the results being used. Required by schedule_hedged
+template <class Fn>
+struct idempotent_task
+{
+	Fn fn;
+};
+
+template <class Fn>
+idempotent_task<std::decay_t<Fn>> idempotent(Fn&& fn)
+{
+	return{ std::forward<Fn>(fn) };
+}
+
+struct hedge_metrics
+{
+	std::uint64_t tasks;           //calls to schedule_hedged
+	std::uint64_t hedges_launched; //duplicates scheduled after the delay
+	std::uint64_t hedges_skipped;  //duplicates dequeued after a copy had won
+	std::uint64_t primary_wins;
+	std::uint64_t hedge_wins;
+};
+
+///Runs tasks with heavy tailed runtimes speculatively: if the first copy
+///hasn't finished after delay, another one is scheduled (and so on, up to
+///max_copies), and the future completes with whichever copy finishes first.
+///Copies still queued when a winner is known are dropped, copies already
+///running finish and their result is discarded.
+///
+///	HedgedScheduler hedged(pool);
+///	auto f = hedged.schedule_hedged(idempotent([key] { return lookup(key); }),
+///		std::chrono::milliseconds(20), 2);
+///
+///NOTE: must outlive the tasks it scheduled
+class HedgedScheduler
+{
+public:
+	explicit HedgedScheduler(Executor_base& executor, TimerQueue& timer = TimerQueue::global()) :
+		m_executor(executor), m_timer(timer) {}
+
+	HedgedScheduler(const HedgedScheduler&) = delete;
+	HedgedScheduler& operator= (const HedgedScheduler&) = delete;
+
+	template <class Idempotent, class Rep, class Period>
+	auto schedule_hedged(Idempotent task, const std::chrono::duration<Rep, Period>& delay,
+		unsigned max_copies = 2, Priority p = MEDIUM)
+	{
+		static_assert(is_idempotent<Idempotent>::value,
+			"only tasks wrapped with idempotent() can be hedged");
+		using Fn = decltype(task.fn);
+		using Res = std::result_of_t<Fn()>;
+
+		auto state = std::make_shared<race<Fn, Res>>(std::move(task.fn), p,
+			max_copies != 0 ? max_copies : 1,
+			std::chrono::duration_cast<TimerQueue::clock::duration>(delay));
+
+		TaskFuture<Res> future = state->promise.get_future();
+		future_state_access::state(future)->set_executor_base(&m_executor);
+
+		m_tasks.fetch_add(1, std::memory_order_relaxed);
+		launch(state, 0);
+		return future;
+	}
+
+	hedge_metrics metrics() const
+	{
+		return{ m_tasks.load(std::memory_order_relaxed),
+			m_hedges_launched.load(std::memory_order_relaxed),
+			m_hedges_skipped.load(std::memory_order_relaxed),
+			m_primary_wins.load(std::memory_order_relaxed),
+			m_hedge_wins.load(std::memory_order_relaxed) };
+	}
+
+private:
+	template <class T> struct is_idempotent : std::false_type {};
+	template <class Fn> struct is_idempotent<idempotent_task<Fn>> : std::true_type {};
+
+	template <class Fn, class Res>
+	struct race
+	{
+		race(Fn&& f, Priority prio, unsigned copies, TimerQueue::clock::duration d) :
+			fn(std::move(f)), p(prio), max_copies(copies), delay(d) {}
+
+		Fn fn;
+		Priority p;
+		unsigned max_copies;
+		TimerQueue::clock::duration delay;
+
+		TaskPromise<Res> promise;
+		std::atomic_bool done{ false };
+		std::atomic<TimerQueue::timer_id> pending_hedge{ 0 };
+	};
+
+	template <class Fn, class Res>
+	void launch(const std::shared_ptr<race<Fn, Res>>& state, unsigned copy)
+	{
+		//Every copy runs its own Fn, the copies may run concurrently
+		m_executor.schedule(make_packaged_task([this, state, copy, fn = state->fn]() mutable
+		{
+			if (state->done.load(std::memory_order_acquire))
+			{
+				m_hedges_skipped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			if constexpr (std::is_void<Res>::value)
+			{
+				fn();
+				if (!win(*state, copy)) return;
+				state->promise.set_value();
+			}
+			else
+			{
+				Res res = fn();
+				if (!win(*state, copy)) return;
+				state->promise.set_value(std::move(res));
+			}
+		}), state->p);
+
+		if (copy + 1 < state->max_copies)
+		{
+			std::weak_ptr<race<Fn, Res>> weak = state;
+			state->pending_hedge = m_timer.call_after(state->delay, [this, weak, copy]
+			{
+				auto s = weak.lock();
+				if (!s || s->done.load(std::memory_order_acquire))
+					return;
+				m_hedges_launched.fetch_add(1, std::memory_order_relaxed);
+				launch(s, copy + 1);
+			});
+		}
+	}
+
+	template <class Race>
+	bool win(Race& state, unsigned copy)
+	{
+		if (state.done.exchange(true, std::memory_order_acq_rel))
+			return false;
+
+		//The next hedge isn't needed anymore
+		m_timer.cancel(state.pending_hedge.load());
+		(copy == 0 ? m_primary_wins : m_hedge_wins).fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	Executor_base& m_executor;
+	TimerQueue& m_timer;
+
+	std::atomic<std::uint64_t> m_tasks{ 0 };
+	std::atomic<std::uint64_t> m_hedges_launched{ 0 };
+	std::atomic<std::uint64_t> m_hedges_skipped{ 0 };
+	std::atomic<std::uint64_t> m_primary_wins{ 0 };
+	std::atomic<std::uint64_t> m_hedge_wins{ 0 };
+};
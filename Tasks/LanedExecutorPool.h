@@ -0,0 +1,234 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <initializer_list>
+#include <stdexcept>
+#include <cstdint>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+struct LaneOptions
+{
+	size_t workers = 1;       //guaranteed share: threads whose home is this lane
+	bool lend_workers = true; //idle home workers may run tasks of other lanes
+	size_t keep_home = 0;     //home workers that are never lent (burst capacity)
+	bool accept_help = true;  //idle workers of other lanes may run our tasks
+};
+
+class LanedExecutorPool;
+
+//A lane is a complete Executor_base (priorities, continuations, resource
+//classes...) that owns no thread: its queue is drained by the workers of
+//the LanedExecutorPool it belongs to.
+class ExecutorLane : public Executor_base, private Executor_base::wake_listener
+{
+	friend class LanedExecutorPool;
+
+public:
+	const std::string& name() const { return m_name; }
+
+private:
+	ExecutorLane(LanedExecutorPool& pool, std::string name, const LaneOptions& opt) :
+		m_pool(pool), m_name(std::move(name)), m_options(opt)
+	{
+		Executor_base::forward_wake_ups(this);
+	}
+
+	void task_queued(bool many) override;
+
+	LanedExecutorPool& m_pool;
+	std::string m_name;
+	LaneOptions m_options;
+
+	std::atomic<size_t> m_lent{ 0 }; //home workers currently on other lanes
+	size_t m_sleepers = 0;           //guarded by the pool mutex
+	std::condition_variable m_cv;    //home workers sleep here
+};
+
+///One set of threads shared by several named lanes. Every lane gets its
+///guaranteed workers; a worker whose lane is empty borrows tasks from the
+///other lanes, as allowed by their LaneOptions.
+///
+///	LanedExecutorPool pool{ { "interactive", { 2, true, 1 } }, { "batch", { 6 } } };
+///	auto& interactive = pool.lane("interactive");
+///	interactive.schedule(task, HIGH).then(...);
+class LanedExecutorPool
+{
+	friend class ExecutorLane;
+
+public:
+	LanedExecutorPool(std::initializer_list<std::pair<std::string, LaneOptions>> lanes)
+	{
+		for (auto&& lane : lanes)
+			m_lanes.emplace_back(new ExecutorLane(*this, lane.first, lane.second));
+
+		for (size_t home = 0; home < m_lanes.size(); ++home)
+			for (size_t x = 0; x < m_lanes[home]->m_options.workers; ++x)
+				m_contexts.emplace_back(new WorkerContext(m_contexts.size()));
+
+		for (size_t home = 0, worker = 0; home < m_lanes.size(); ++home)
+			for (size_t x = 0; x < m_lanes[home]->m_options.workers; ++x, ++worker)
+				m_threads.emplace_back(&LanedExecutorPool::run, this, home, worker);
+	}
+
+	~LanedExecutorPool()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_alive = false;
+		}
+
+		for (auto&& lane : m_lanes)
+			lane->m_cv.notify_all();
+
+		for (auto&& thread : m_threads)
+			thread.join();
+	}
+
+	LanedExecutorPool(const LanedExecutorPool&) = delete;
+	LanedExecutorPool& operator= (const LanedExecutorPool&) = delete;
+
+	//Look the lane up once and keep the reference around
+	ExecutorLane& lane(const std::string& name)
+	{
+		for (auto&& lane : m_lanes)
+			if (lane->m_name == name)
+				return *lane;
+
+		throw std::out_of_range("no lane named " + name);
+	}
+
+	ExecutorLane& lane(size_t index) { return *m_lanes.at(index); }
+	size_t lane_count() const { return m_lanes.size(); }
+
+	//Workers are numbered across all lanes, in the order the lanes were given
+	size_t worker_count() const { return m_contexts.size(); }
+	WorkerContext& worker_context(size_t worker) { return *m_contexts.at(worker); }
+
+	template <class TTask>
+	decltype(auto) schedule(const std::string& lane_name, TTask&& task, Priority p = MEDIUM)
+	{
+		return lane(lane_name).schedule(std::forward<TTask>(task), p);
+	}
+
+private:
+	void run(size_t home, size_t worker)
+	{
+		ExecutorLane& own = *m_lanes[home];
+		WorkerContext& context = *m_contexts[worker];
+		WorkerContext::scope context_scope(context);
+
+		while (true)
+		{
+			//Anything queued after this read bumps the epoch, so we can't
+			//miss it between the checks below and going to sleep
+			auto epoch = m_epoch.load(std::memory_order_acquire);
+
+			if (own.try_run_one() || try_borrow(own, home))
+			{
+				context.task_finished();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lk(m_mutex);
+			if (!m_alive) break;
+			if (epoch != m_epoch.load(std::memory_order_relaxed))
+				continue;
+
+			++own.m_sleepers;
+			own.m_cv.wait(lk);
+			--own.m_sleepers;
+
+			if (!m_alive) break;
+		}
+	}
+
+	//Home workers the lane may have on other lanes at once
+	static size_t lendable(const ExecutorLane& lane)
+	{
+		const LaneOptions& opt = lane.m_options;
+		return opt.lend_workers && opt.keep_home < opt.workers ? opt.workers - opt.keep_home : 0;
+	}
+
+	bool try_borrow(ExecutorLane& own, size_t home)
+	{
+		size_t limit = lendable(own);
+		if (limit == 0 || own.m_lent.load(std::memory_order_relaxed) >= limit)
+			return false;
+
+		//Take the place first, other home workers may be checking too
+		if (own.m_lent.fetch_add(1) >= limit)
+		{
+			--own.m_lent;
+			return false;
+		}
+
+		bool ran = false;
+		for (size_t x = 1; x < m_lanes.size() && !ran; ++x)
+		{
+			ExecutorLane& other = *m_lanes[(home + x) % m_lanes.size()];
+			if (other.m_options.accept_help)
+				ran = other.try_run_one();
+		}
+		--own.m_lent;
+		return ran;
+	}
+
+	//m_mutex must be held
+	static bool may_help(const ExecutorLane& lane)
+	{
+		return lane.m_sleepers != 0 && lane.m_lent.load(std::memory_order_relaxed) < lendable(lane);
+	}
+
+	//Wakes a home worker of the lane, or else an idle worker that may help
+	void task_queued(ExecutorLane& lane, bool many)
+	{
+		std::condition_variable* target = nullptr;
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_epoch.fetch_add(1, std::memory_order_release);
+
+			if (lane.m_sleepers != 0)
+				target = &lane.m_cv;
+			else if (lane.m_options.accept_help)
+				for (auto&& other : m_lanes)
+					if (may_help(*other))
+					{
+						target = &other->m_cv;
+						break;
+					}
+		}
+
+		//Workers of lanes that can't lend would go right back to sleep
+		if (many)
+		{
+			lane.m_cv.notify_all();
+			if (lane.m_options.accept_help)
+				for (auto&& other : m_lanes)
+					if (other.get() != &lane && lendable(*other) != 0)
+						other->m_cv.notify_all();
+		}
+		else if (target != nullptr)
+			target->notify_one();
+	}
+
+	std::vector<std::unique_ptr<ExecutorLane>> m_lanes;
+	std::vector<std::unique_ptr<WorkerContext>> m_contexts;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::atomic<std::uint64_t> m_epoch{ 0 };
+	bool m_alive = true;
+};
+
+inline void ExecutorLane::task_queued(bool many)
+{
+	m_pool.task_queued(*this, many);
+}
@@ -0,0 +1,452 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <optional>
+#include <stdexcept>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+///Bounded lock-free ring buffer (D. Vyukov's MPMC scheme). Every cell carries
+///a sequence number, so producers and consumers only contend on their own
+///index. A single producer/consumer pair never touches the other's counter,
+///which makes it a perfectly good SPSC channel as well.
+template <class T>
+class bounded_channel
+{
+public:
+	explicit bounded_channel(size_t capacity) :
+		m_mask(round_up_pow2(capacity) - 1),
+		m_capacity(capacity),
+		m_cells(new cell[m_mask + 1])
+	{
+		for (size_t x = 0; x <= m_mask; ++x)
+			m_cells[x].sequence.store(x, std::memory_order_relaxed);
+	}
+
+	bounded_channel(const bounded_channel&) = delete;
+	bounded_channel& operator= (const bounded_channel&) = delete;
+
+	//Nobody pushes or pops anymore: destroy what is left in place
+	~bounded_channel()
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		for (size_t pos = m_head.load(std::memory_order_relaxed); pos != tail; ++pos)
+			reinterpret_cast<T*>(&m_cells[pos & m_mask].storage)->~T();
+	}
+
+	//Returns false (and leaves value untouched) if the channel is full
+	bool try_push(T&& value)
+	{
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+		cell* c;
+		while (true)
+		{
+			c = &m_cells[pos & m_mask];
+			size_t seq = c->sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+			if (diff == 0)
+			{
+				//The ring is rounded up to a power of two, enforce the real bound
+				auto used = static_cast<std::ptrdiff_t>(pos - m_head.load(std::memory_order_acquire));
+				if (used >= static_cast<std::ptrdiff_t>(m_capacity))
+					return false;
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+
+		new (&c->storage) T(std::move(value));
+		c->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	//Returns false if the channel is empty
+	bool try_pop(T& value)
+	{
+		return pop_into([&value](T&& stored) { value = std::move(stored); });
+	}
+
+	//Same, for types that are not default constructible
+	bool try_pop(std::optional<T>& value)
+	{
+		return pop_into([&value](T&& stored) { value.emplace(std::move(stored)); });
+	}
+
+	//Spins (yielding) until there is room. Only meant for producers that
+	//are not executor threads, otherwise the consumer may never get to run.
+	void push(T&& value)
+	{
+		while (!try_push(std::move(value)))
+			std::this_thread::yield();
+	}
+
+	//Approximate while other threads are pushing or popping
+	size_t size() const
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t head = m_head.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+	bool empty() const { return size() == 0; }
+	size_t capacity() const { return m_capacity; }
+
+private:
+	template <class Store>
+	bool pop_into(Store&& store)
+	{
+		size_t pos = m_head.load(std::memory_order_relaxed);
+		cell* c;
+		while (true)
+		{
+			c = &m_cells[pos & m_mask];
+			size_t seq = c->sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+			if (diff == 0)
+			{
+				if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = m_head.load(std::memory_order_relaxed);
+		}
+
+		T* stored = reinterpret_cast<T*>(&c->storage);
+		store(std::move(*stored));
+		stored->~T();
+		c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	static size_t round_up_pow2(size_t x)
+	{
+		size_t res = 2;
+		while (res < x) res <<= 1;
+		return res;
+	}
+
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+	};
+
+	const size_t m_mask;
+	const size_t m_capacity;
+	std::unique_ptr<cell[]> m_cells;
+
+	//Keep producers and consumers on separate cache lines
+	alignas(64) std::atomic<size_t> m_tail{ 0 };
+	alignas(64) std::atomic<size_t> m_head{ 0 };
+};
+
+struct StageOptions
+{
+	size_t parallelism = 1; //max drain tasks of the stage alive at once
+	size_t batch_size = 64; //records handled by a drain task before it yields the worker
+	size_t capacity = 1024; //bound of the stage input channel
+	Priority priority = MEDIUM;
+};
+
+namespace impl
+{
+	//Upstream side of a stage, poked when the stage frees room in its input
+	class pipeline_resumable
+	{
+	public:
+		virtual ~pipeline_resumable() {}
+		virtual void resume() = 0;
+	};
+
+	template <class In>
+	class pipeline_input
+	{
+	public:
+		virtual ~pipeline_input() {}
+
+		//Never fails if has_room() was true, given that at most
+		//`upstream parallelism` producers raced on the check
+		virtual void push(In&& rec) = 0;
+		virtual bool has_room() const = 0;
+		virtual void producer_done() = 0;
+		virtual void set_upstream(std::weak_ptr<pipeline_resumable> up, size_t parallelism) = 0;
+	};
+
+	template <class Out>
+	class pipeline_output
+	{
+	public:
+		virtual ~pipeline_output() {}
+		virtual void set_next(std::shared_ptr<pipeline_input<Out>> next) = 0;
+	};
+
+	//Common part of transform stages and sinks. Drain tasks are only
+	//scheduled while the input has records, so an idle stage holds no worker
+	template <class In, class Derived>
+	class pipeline_stage_base :
+		public pipeline_input<In>,
+		public pipeline_resumable,
+		public std::enable_shared_from_this<Derived>
+	{
+	public:
+		pipeline_stage_base(Executor_base& executor, const StageOptions& opt) :
+			m_executor(&executor), m_options(opt) {}
+
+		void push(In&& rec) override
+		{
+			//has_room() left enough slack for the racing producers, so
+			//this only spins if the caller ignored the backpressure
+			m_input->push(std::move(rec));
+			ensure_draining();
+		}
+
+		bool has_room() const override
+		{
+			return m_input->size() < m_options.capacity;
+		}
+
+		void producer_done() override
+		{
+			m_upstream_done = true;
+			try_finish();
+		}
+
+		void set_upstream(std::weak_ptr<pipeline_resumable> up, size_t parallelism) override
+		{
+			//No room ever, no drain task ever, or drain tasks that never
+			//drain: each one hangs the pipeline
+			if (m_options.capacity == 0)
+				throw std::invalid_argument("StageOptions::capacity must be at least 1");
+			if (m_options.parallelism == 0)
+				throw std::invalid_argument("StageOptions::parallelism must be at least 1");
+			if (m_options.batch_size == 0)
+				throw std::invalid_argument("StageOptions::batch_size must be at least 1");
+
+			m_upstream = std::move(up);
+			m_input = std::make_unique<bounded_channel<In>>(m_options.capacity + parallelism);
+		}
+
+		void resume() override
+		{
+			ensure_draining();
+		}
+
+	protected:
+		void ensure_draining()
+		{
+			size_t active = m_active.load();
+			while (active < m_options.parallelism && !m_input->empty())
+			{
+				if (m_active.compare_exchange_weak(active, active + 1))
+				{
+					auto self = this->shared_from_this();
+					m_executor->schedule(make_packaged_task(
+						[self] { self->drain(); }), m_options.priority);
+					return;
+				}
+			}
+		}
+
+		void drain()
+		{
+			auto* derived = static_cast<Derived*>(this);
+			size_t done = 0;
+			std::optional<In> rec;
+			while (done < m_options.batch_size && derived->output_has_room()
+				&& m_input->try_pop(rec))
+			{
+				derived->process(std::move(*rec));
+				rec.reset();
+				++done;
+			}
+
+			//Room was freed: let a stalled upstream continue
+			if (done != 0)
+				if (auto up = m_upstream.lock())
+					up->resume();
+
+			--m_active;
+
+			//Recheck after decrementing, a push may have raced with us.
+			//If the output is full the downstream stage resumes us instead
+			if (!m_input->empty() && derived->output_has_room())
+				ensure_draining();
+			else
+				try_finish();
+		}
+
+		void try_finish()
+		{
+			if (m_upstream_done && m_active == 0 && m_input->empty()
+				&& !m_finished.exchange(true))
+				static_cast<Derived*>(this)->finish();
+		}
+
+	protected:
+		Executor_base* m_executor;
+		StageOptions m_options;
+
+	private:
+		std::unique_ptr<bounded_channel<In>> m_input;
+		std::weak_ptr<pipeline_resumable> m_upstream;
+		std::atomic<size_t> m_active{ 0 };
+		std::atomic_bool m_upstream_done{ false };
+		std::atomic_bool m_finished{ false };
+	};
+
+	template <class In, class Out, class Fn>
+	class pipeline_stage final :
+		public pipeline_stage_base<In, pipeline_stage<In, Out, Fn>>,
+		public pipeline_output<Out>
+	{
+		using _Base = pipeline_stage_base<In, pipeline_stage<In, Out, Fn>>;
+		friend _Base;
+
+	public:
+		pipeline_stage(Executor_base& executor, const StageOptions& opt, Fn fn) :
+			_Base(executor, opt), m_fn(std::move(fn)) {}
+
+		void set_next(std::shared_ptr<pipeline_input<Out>> next) override
+		{
+			m_next = std::move(next);
+			m_next->set_upstream(this->shared_from_this(), _Base::m_options.parallelism);
+		}
+
+	private:
+		bool output_has_room() const { return m_next->has_room(); }
+		void process(In&& rec) { m_next->push(m_fn(std::move(rec))); }
+		void finish() { m_next->producer_done(); }
+
+		Fn m_fn;
+		std::shared_ptr<pipeline_input<Out>> m_next;
+	};
+
+	template <class In, class Fn>
+	class pipeline_sink final :
+		public pipeline_stage_base<In, pipeline_sink<In, Fn>>
+	{
+		using _Base = pipeline_stage_base<In, pipeline_sink<In, Fn>>;
+		friend _Base;
+
+	public:
+		pipeline_sink(Executor_base& executor, const StageOptions& opt, Fn fn) :
+			_Base(executor, opt), m_fn(std::move(fn)) {}
+
+		TaskFuture<void> get_future() { return m_done.get_future(); }
+
+	private:
+		bool output_has_room() const { return true; }
+		void process(In&& rec) { m_fn(std::move(rec)); }
+		void finish() { m_done.set_value(); }
+
+		Fn m_fn;
+		TaskPromise<void> m_done;
+	};
+} // namespace impl
+
+///A running pipeline. Records are pushed at the head and flow through the
+///stages; close() marks the end of the stream.
+template <class T>
+class Pipeline
+{
+public:
+	Pipeline(std::shared_ptr<impl::pipeline_input<T>> head, TaskFuture<void>&& done) :
+		m_head(std::move(head)), m_done(std::move(done)) {}
+
+	//Blocks (yielding) while the first stage is at capacity
+	void push(T rec)
+	{
+		while (!m_head->has_room())
+			std::this_thread::yield();
+		m_head->push(std::move(rec));
+	}
+
+	bool try_push(T& rec)
+	{
+		if (!m_head->has_room()) return false;
+		m_head->push(std::move(rec));
+		return true;
+	}
+
+	void close() { m_head->producer_done(); }
+
+	//Waits until every record went through the sink. Call close() first!
+	void wait() { m_done.wait(); }
+
+private:
+	std::shared_ptr<impl::pipeline_input<T>> m_head;
+	TaskFuture<void> m_done;
+};
+
+///Builds a pipeline stage by stage. Source is the type pushed at the head,
+///Current the type produced by the last stage added so far.
+template <class Source, class Current = Source>
+class PipelineBuilder
+{
+	template <class, class> friend class PipelineBuilder;
+
+public:
+	PipelineBuilder() = default;
+
+	template <class Fn>
+	auto stage(Executor_base& executor, Fn fn, const StageOptions& opt = StageOptions{}) &&
+	{
+		using Out = std::result_of_t<Fn(Current)>;
+		static_assert(!std::is_same<Out, void>::value,
+			"the last stage of a pipeline must be added with sink()");
+
+		auto node = std::make_shared<impl::pipeline_stage<Current, Out, Fn>>(
+			executor, opt, std::move(fn));
+		link(node);
+
+		PipelineBuilder<Source, Out> res;
+		res.m_head = std::move(m_head);
+		res.m_tail = node;
+		return res;
+	}
+
+	template <class Fn>
+	Pipeline<Source> sink(Executor_base& executor, Fn fn, const StageOptions& opt = StageOptions{}) &&
+	{
+		auto node = std::make_shared<impl::pipeline_sink<Current, Fn>>(
+			executor, opt, std::move(fn));
+		link(node);
+
+		return Pipeline<Source>(std::move(m_head), node->get_future());
+	}
+
+private:
+	template <class Node>
+	void link(const std::shared_ptr<Node>& node)
+	{
+		if (m_tail)
+			m_tail->set_next(node);
+		else if constexpr (std::is_same<Source, Current>::value)
+		{
+			//First stage: the producer is whoever calls Pipeline::push
+			node->set_upstream(std::weak_ptr<impl::pipeline_resumable>{}, 1);
+			m_head = node;
+		}
+	}
+
+	std::shared_ptr<impl::pipeline_input<Source>> m_head;
+	std::shared_ptr<impl::pipeline_output<Current>> m_tail;
+};
+
+template <class T>
+PipelineBuilder<T> make_pipeline()
+{
+	return{};
+}
@@ -0,0 +1,627 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+///Compile-time configured executors. Every feature is a policy template
+///parameter, so the ones that are not selected compile away entirely:
+///
+///	BasicExecutorPool<4, policy::fifo_queue, policy::spinning_idle,
+///		policy::heap_allocator, policy::metrics_disabled,
+///		policy::continuations_disabled> pool;
+///
+///Queued tasks are stored by value in a task_record and run through a plain
+///function pointer: no Executable, no TaskExe, no virtual call.
+
+namespace policy
+{
+	/////////////////////////////////////////////////////////////////////
+	// Queue policies. The executor mutex is held around every call
+
+	//Highest Priority first, FIFO within the same priority
+	struct priority_queue
+	{
+		template <class Record>
+		class queue
+		{
+		public:
+			void push(Record&& rec)
+			{
+				m_heap.push_back(std::move(rec));
+				std::push_heap(m_heap.begin(), m_heap.end(), compare{});
+			}
+
+			bool try_pop(Record& rec)
+			{
+				if (m_heap.empty()) return false;
+
+				std::pop_heap(m_heap.begin(), m_heap.end(), compare{});
+				rec = std::move(m_heap.back());
+				m_heap.pop_back();
+				return true;
+			}
+
+			bool empty() const { return m_heap.empty(); }
+			size_t size() const { return m_heap.size(); }
+
+		private:
+			struct compare
+			{
+				bool operator()(const Record& lhs, const Record& rhs) const
+				{
+					if (lhs.priority != rhs.priority)
+						return lhs.priority < rhs.priority;
+					return lhs.sequence > rhs.sequence;
+				}
+			};
+
+			std::vector<Record> m_heap;
+		};
+	};
+
+	//Ignores Priority altogether
+	struct fifo_queue
+	{
+		template <class Record>
+		class queue
+		{
+		public:
+			void push(Record&& rec) { m_queue.push_back(std::move(rec)); }
+
+			bool try_pop(Record& rec)
+			{
+				if (m_queue.empty()) return false;
+
+				rec = std::move(m_queue.front());
+				m_queue.pop_front();
+				return true;
+			}
+
+			bool empty() const { return m_queue.empty(); }
+			size_t size() const { return m_queue.size(); }
+
+		private:
+			std::deque<Record> m_queue;
+		};
+	};
+
+	/////////////////////////////////////////////////////////////////////
+	// Idle policies: what a worker does when the queue is empty
+
+	//Sleep on a condition variable straight away
+	struct blocking_idle
+	{
+		template <class Lock, class Pred>
+		void wait(Lock& lk, Pred ready) { m_cv.wait(lk, ready); }
+
+		void notify_one() { m_cv.notify_one(); }
+		void notify_all() { m_cv.notify_all(); }
+
+	private:
+		std::condition_variable m_cv;
+	};
+
+	//Yield for a while before sleeping. Producers skip the notification
+	//entirely while nobody is actually asleep
+	template <size_t SPINS = 64>
+	struct basic_spinning_idle
+	{
+		template <class Lock, class Pred>
+		void wait(Lock& lk, Pred ready)
+		{
+			for (size_t x = 0; x < SPINS; ++x)
+			{
+				if (ready()) return;
+				lk.unlock();
+				std::this_thread::yield();
+				lk.lock();
+			}
+
+			++m_sleepers;
+			m_cv.wait(lk, ready);
+			--m_sleepers;
+		}
+
+		void notify_one() { if (m_sleepers != 0) m_cv.notify_one(); }
+		void notify_all() { m_cv.notify_all(); }
+
+	private:
+		std::condition_variable m_cv;
+		std::atomic<size_t> m_sleepers{ 0 };
+	};
+
+	using spinning_idle = basic_spinning_idle<>;
+
+	/////////////////////////////////////////////////////////////////////
+	// Allocator policies, only used for callables too big for a task_record
+
+	struct heap_allocator
+	{
+		static void* allocate(size_t size) { return ::operator new(size); }
+		static void deallocate(void* p, size_t) { ::operator delete(p); }
+	};
+
+	//Recycles blocks of up to BLOCK bytes. Each thread keeps up to CACHE
+	//free blocks of its own and exchanges half of them at a time with a
+	//shared list, so blocks freed by workers get back to the producer. The
+	//number of blocks is bounded by the peak of live ones plus the caches;
+	//a thread's cache goes back to the shared list when it exits, the shared
+	//list to the heap at program exit. Bigger requests go to the heap
+	template <size_t BLOCK = 256, size_t CACHE = 64>
+	struct basic_pooled_allocator
+	{
+		static_assert(CACHE >= 2, "blocks move between caches CACHE / 2 at a time");
+
+		static void* allocate(size_t size)
+		{
+			if (size > BLOCK)
+				return ::operator new(size);
+
+			local_cache& cache = local();
+			if (cache.head == nullptr && !cache.refill())
+				return ::operator new(BLOCK);
+
+			block* res = cache.head;
+			cache.head = res->next;
+			--cache.count;
+			return res;
+		}
+
+		static void deallocate(void* p, size_t size)
+		{
+			if (size > BLOCK)
+			{
+				::operator delete(p);
+				return;
+			}
+
+			local_cache& cache = local();
+			if (cache.count == CACHE)
+				cache.spill(CACHE / 2);
+
+			cache.head = new (p) block{ cache.head };
+			++cache.count;
+		}
+
+	private:
+		struct block { block* next; };
+
+		struct shared_list
+		{
+			~shared_list()
+			{
+				while (head != nullptr)
+				{
+					block* next = head->next;
+					::operator delete(head);
+					head = next;
+				}
+			}
+
+			std::mutex mutex;
+			block* head = nullptr;
+		};
+
+		struct local_cache
+		{
+			//Touching the shared list first makes it outlive every cache
+			local_cache() : shared(shared_blocks()) {}
+			~local_cache() { spill(count); }
+
+			//Takes up to CACHE / 2 blocks from the shared list
+			bool refill()
+			{
+				std::lock_guard<std::mutex> lk(shared.mutex);
+				while (shared.head != nullptr && count < CACHE / 2)
+				{
+					block* b = shared.head;
+					shared.head = b->next;
+					b->next = head;
+					head = b;
+					++count;
+				}
+				return head != nullptr;
+			}
+
+			//Hands n blocks over to the shared list
+			void spill(size_t n)
+			{
+				if (n == 0)
+					return;
+
+				block* first = head;
+				block* last = head;
+				for (size_t x = 1; x < n; ++x)
+					last = last->next;
+				head = last->next;
+				count -= n;
+
+				std::lock_guard<std::mutex> lk(shared.mutex);
+				last->next = shared.head;
+				shared.head = first;
+			}
+
+			shared_list& shared;
+			block* head = nullptr;
+			size_t count = 0;
+		};
+
+		static shared_list& shared_blocks()
+		{
+			static shared_list list;
+			return list;
+		}
+
+		static local_cache& local()
+		{
+			static thread_local local_cache cache;
+			return cache;
+		}
+	};
+
+	using pooled_allocator = basic_pooled_allocator<>;
+
+	/////////////////////////////////////////////////////////////////////
+	// Metrics policies
+
+	struct executor_metrics
+	{
+		std::uint64_t scheduled;
+		std::uint64_t executed;
+		size_t queued;
+	};
+
+	struct metrics_disabled
+	{
+		void on_schedule() {}
+		void on_execute() {}
+	};
+
+	struct metrics_enabled
+	{
+		void on_schedule() { m_scheduled.fetch_add(1, std::memory_order_relaxed); }
+		void on_execute() { m_executed.fetch_add(1, std::memory_order_relaxed); }
+
+		executor_metrics snapshot(size_t queued) const
+		{
+			return{ m_scheduled.load(std::memory_order_relaxed),
+				m_executed.load(std::memory_order_relaxed), queued };
+		}
+
+	private:
+		std::atomic<std::uint64_t> m_scheduled{ 0 };
+		std::atomic<std::uint64_t> m_executed{ 0 };
+	};
+
+	/////////////////////////////////////////////////////////////////////
+	// Continuation policies (the DISABLE_CONTINUATIONS of these executors)
+
+	struct continuations_enabled { static constexpr bool enabled = true; };
+	struct continuations_disabled { static constexpr bool enabled = false; };
+} // namespace policy
+
+namespace impl
+{
+	//A queued task stored by value. Callables that fit (and can be moved
+	//without throwing) live inside the record, the others are allocated
+	//through the Alloc policy. Either way it runs through m_invoke.
+	template <class Alloc>
+	class task_record
+	{
+	public:
+		static constexpr size_t inline_size = 48;
+
+		task_record() = default;
+
+		template <class Fn>
+		task_record(Fn&& fn, Priority p, std::uint64_t seq) :
+			priority(p), sequence(seq)
+		{
+			using F = std::decay_t<Fn>;
+			construct<F>(std::forward<Fn>(fn), is_inline<F>{});
+		}
+
+		task_record(task_record&& other) noexcept { steal(other); }
+
+		task_record& operator=(task_record&& other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				steal(other);
+			}
+			return *this;
+		}
+
+		~task_record() { reset(); }
+
+		void operator()() { m_invoke(&m_storage); }
+
+		Priority priority = MEDIUM;
+		std::uint64_t sequence = 0;
+
+	private:
+		enum class op { move, destroy };
+		using invoke_fn = void(*)(void*);
+		using manage_fn = void(*)(op, void*, void*);
+
+		template <class F>
+		using is_inline = std::integral_constant<bool,
+			sizeof(F) <= inline_size &&
+			alignof(F) <= alignof(std::max_align_t) &&
+			std::is_nothrow_move_constructible<F>::value>;
+
+		template <class F, class Fn>
+		void construct(Fn&& fn, std::true_type)
+		{
+			new (&m_storage) F(std::forward<Fn>(fn));
+			m_invoke = [](void* s) { (*static_cast<F*>(s))(); };
+			m_manage = [](op o, void* src, void* dst)
+			{
+				F* f = static_cast<F*>(src);
+				if (o == op::move)
+					new (dst) F(std::move(*f));
+				f->~F();
+			};
+		}
+
+		template <class F, class Fn>
+		void construct(Fn&& fn, std::false_type)
+		{
+			void* mem = Alloc::allocate(sizeof(F));
+			*reinterpret_cast<F**>(&m_storage) = new (mem) F(std::forward<Fn>(fn));
+			m_invoke = [](void* s) { (**static_cast<F**>(s))(); };
+			m_manage = [](op o, void* src, void* dst)
+			{
+				F* f = *static_cast<F**>(src);
+				if (o == op::move)
+				{
+					*static_cast<F**>(dst) = f;
+					return;
+				}
+				f->~F();
+				Alloc::deallocate(f, sizeof(F));
+			};
+		}
+
+		void steal(task_record& other)
+		{
+			priority = other.priority;
+			sequence = other.sequence;
+			m_invoke = other.m_invoke;
+			m_manage = other.m_manage;
+			if (m_manage != nullptr)
+				m_manage(op::move, &other.m_storage, &m_storage);
+			other.m_invoke = nullptr;
+			other.m_manage = nullptr;
+		}
+
+		void reset()
+		{
+			if (m_manage != nullptr)
+				m_manage(op::destroy, &m_storage, nullptr);
+			m_invoke = nullptr;
+			m_manage = nullptr;
+		}
+
+		invoke_fn m_invoke = nullptr;
+		manage_fn m_manage = nullptr;
+		std::aligned_storage_t<inline_size, alignof(std::max_align_t)> m_storage;
+	};
+
+	//Sets the promise from the result of fn, void included
+	template <class Res, class Fn, class... Args>
+	void fulfill(TaskPromise<Res>& promise, Fn& fn, Args&&... args)
+	{
+		if constexpr (std::is_void<Res>::value)
+		{
+			fn(std::forward<Args>(args)...);
+			promise.set_value();
+		}
+		else
+			promise.set_value(fn(std::forward<Args>(args)...));
+	}
+} // namespace impl
+
+template <size_t WORKERS,
+	class QueuePolicy = policy::priority_queue,
+	class IdlePolicy = policy::blocking_idle,
+	class AllocPolicy = policy::heap_allocator,
+	class MetricsPolicy = policy::metrics_disabled,
+	class ContinuationPolicy = policy::continuations_enabled>
+class BasicExecutorPool : private MetricsPolicy
+{
+	using record = impl::task_record<AllocPolicy>;
+
+public:
+	BasicExecutorPool()
+	{
+		for (auto x = 0u; x < WORKERS; ++x)
+			m_contexts.emplace_back(new WorkerContext(x));
+
+		for (auto x = 0u; x < WORKERS; ++x)
+			m_workers[x] = std::thread(&BasicExecutorPool::run, this, x);
+	}
+
+	~BasicExecutorPool()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_alive = false;
+		}
+		m_idle.notify_all();
+
+		for (auto&& worker : m_workers)
+			worker.join();
+	}
+
+	BasicExecutorPool(const BasicExecutorPool&) = delete;
+	BasicExecutorPool& operator= (const BasicExecutorPool&) = delete;
+
+	//Fire and forget: the cheapest way in, no shared state is allocated
+	template <class Fn>
+	void post(Fn&& fn, Priority p = MEDIUM)
+	{
+		push(record(std::forward<Fn>(fn), p, 0));
+	}
+
+	template <class Fn>
+	auto schedule(Fn&& fn, Priority p = MEDIUM)
+	{
+		using Res = std::result_of_t<std::decay_t<Fn>()>;
+
+		TaskPromise<Res> promise;
+		TaskFuture<Res> future = promise.get_future();
+
+		post([fn = std::forward<Fn>(fn), promise = std::move(promise)]() mutable
+		{
+			impl::fulfill(promise, fn);
+		}, p);
+
+		return future;
+	}
+
+	//These futures belong to no Executor_base, so future.then() is not
+	//available on them; attach continuations through the executor instead.
+	//fn takes either the TaskFuture or its value
+	template <class Res, class Fn>
+	auto then(TaskFuture<Res>& future, Fn&& fn, Priority p = MEDIUM)
+	{
+		static_assert(ContinuationPolicy::enabled,
+			"continuations are disabled for this executor");
+
+		using Future = TaskFuture<Res>;
+		using FnType = std::decay_t<Fn>;
+		using ContRes = typename continuation_result<FnType, Res,
+			std::is_invocable<FnType&, Future>::value>::type;
+
+		TaskPromise<ContRes> promise;
+		TaskFuture<ContRes> res = promise.get_future();
+		auto state = future_state_access::state(future);
+
+		//The node runs inline when the antecedent becomes ready and
+		//only queues the real continuation here
+		state->add_continuation(std::make_unique<continuation_node<Res, FnType, ContRes>>(
+			*this, std::move(future), std::forward<Fn>(fn), std::move(promise), p));
+
+		return res;
+	}
+
+	template <class M = MetricsPolicy>
+	policy::executor_metrics metrics() const
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+		return M::snapshot(m_queue.size());
+	}
+
+	size_t worker_count() const { return WORKERS; }
+	WorkerContext& worker_context(size_t worker) { return *m_contexts.at(worker); }
+
+private:
+	template <class FnType, class Res, bool TakesFuture>
+	struct continuation_result
+	{
+		using type = std::result_of_t<FnType&(TaskFuture<Res>)>;
+	};
+
+	template <class FnType, class Res>
+	struct continuation_result<FnType, Res, false>
+	{
+		using type = std::result_of_t<FnType&(Res)>;
+	};
+
+	template <class FnType>
+	struct continuation_result<FnType, void, false>
+	{
+		using type = std::result_of_t<FnType&()>;
+	};
+
+	template <class Res, class Fn, class ContRes>
+	class continuation_node final : public Executable
+	{
+	public:
+		continuation_node(BasicExecutorPool& owner, TaskFuture<Res>&& future,
+			Fn fn, TaskPromise<ContRes>&& promise, Priority p) :
+			Executable(p, typeid(continuation_node)),
+			m_owner(owner), m_future(std::move(future)),
+			m_fn(std::move(fn)), m_promise(std::move(promise)) {}
+
+		void execute() override
+		{
+			m_owner.post([future = std::move(m_future), fn = std::move(m_fn),
+				promise = std::move(m_promise)]() mutable
+			{
+				if constexpr (std::is_invocable<Fn&, TaskFuture<Res>>::value)
+					impl::fulfill(promise, fn, std::move(future));
+				else if constexpr (std::is_void<Res>::value)
+				{
+					future.get();
+					impl::fulfill(promise, fn);
+				}
+				else
+					impl::fulfill(promise, fn, future.get());
+			}, m_priority);
+		}
+
+	private:
+		BasicExecutorPool& m_owner;
+		TaskFuture<Res> m_future;
+		Fn m_fn;
+		TaskPromise<ContRes> m_promise;
+	};
+
+	void push(record&& rec)
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			rec.sequence = m_sequence++;
+			m_queue.push(std::move(rec));
+		}
+		MetricsPolicy::on_schedule();
+		m_idle.notify_one();
+	}
+
+	void run(size_t worker)
+	{
+		record rec;
+		WorkerContext& context = *m_contexts[worker];
+		WorkerContext::scope context_scope(context);
+
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mutex);
+				m_idle.wait(lk, [this] { return !m_queue.empty() || !m_alive; });
+
+				if (!m_alive) break;
+
+				m_queue.try_pop(rec);
+			}
+
+			rec();
+			rec = record();
+			context.task_finished();
+			MetricsPolicy::on_execute();
+		}
+	}
+
+	mutable std::mutex m_mutex;
+	typename QueuePolicy::template queue<record> m_queue;
+	IdlePolicy m_idle;
+	std::uint64_t m_sequence = 0;
+	bool m_alive = true;
+	std::vector<std::unique_ptr<WorkerContext>> m_contexts;
+	std::thread m_workers[WORKERS];
+};
@@ -0,0 +1,257 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+#include "Timer.h"
+
+struct RateLimitOptions
+{
+	double tokens_per_second = 100; //sustained rate, must be > 0
+	double burst = 1;               //bucket capacity, tasks admitted back to back
+	std::chrono::milliseconds release_interval{ 10 }; //minimum time between two releases
+};
+
+struct rate_limiter_stats
+{
+	std::uint64_t admitted; //scheduled right away, a token was available
+	std::uint64_t held;     //parked in the side queue
+	std::uint64_t released; //moved from the side queue to the executor
+	std::uint64_t releases; //timer wake ups that released something
+	size_t waiting;         //currently parked
+};
+
+///Token bucket in front of an executor. Tasks within the rate go straight
+///to the executor; the others wait in a side queue, off the workers, and
+///are released by the timer in batches: at most one wake up per
+///release_interval, moving as many tasks as tokens accumulated meanwhile.
+///One limiter for everything submitted to an executor limits the executor,
+///one per task class (disk, database...) only throttles that class while
+///the rest of the work keeps the pool busy.
+///
+///	RateLimiter disk(pool, { 200, 8 }); //200 tasks per second, bursts of 8
+///	auto f = disk.schedule([path] { return load(path); });
+///
+///NOTE: held tasks are released in FIFO order, whatever their priority.
+///Destroying the limiter releases whatever is still held at once
+class RateLimiter
+{
+	using clock = TimerQueue::clock;
+	using tenant_id = Executor_base::tenant_id;
+
+public:
+	explicit RateLimiter(Executor_base& executor, const RateLimitOptions& opt = RateLimitOptions{},
+		TimerQueue& timer = TimerQueue::global()) :
+		m_bucket(std::make_shared<bucket>(executor, timer, opt))
+	{}
+
+	~RateLimiter()
+	{
+		m_bucket->flush();
+	}
+
+	RateLimiter(const RateLimiter&) = delete;
+	RateLimiter& operator= (const RateLimiter&) = delete;
+
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule(PackagedTask<Res(Args...)>&& task, Priority p = MEDIUM)
+	{
+		return schedule_for(Executor_base::no_tenant, std::move(task), p);
+	}
+
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule(PackagedTask<Res(Args...)>& task, Priority p = MEDIUM)
+	{
+		return schedule(std::move(task), p);
+	}
+
+	template <class Fn>
+	decltype(auto) schedule(Fn&& fn, Priority p = MEDIUM)
+	{
+		return schedule(make_packaged_task(std::forward<Fn>(fn)), p);
+	}
+
+	//Same, on behalf of a tenant of the executor (see Executor_base::add_tenant).
+	//Held tasks join the tenant's share when they are released
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule_for(tenant_id tenant, PackagedTask<Res(Args...)>&& task, Priority p = MEDIUM)
+	{
+		auto packaged = m_bucket->executor.package(std::move(task), p);
+		bucket::submit(m_bucket, std::move(packaged.second), tenant);
+		return std::move(packaged.first);
+	}
+
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule_for(tenant_id tenant, PackagedTask<Res(Args...)>& task, Priority p = MEDIUM)
+	{
+		return schedule_for(tenant, std::move(task), p);
+	}
+
+	template <class Fn>
+	decltype(auto) schedule_for(tenant_id tenant, Fn&& fn, Priority p = MEDIUM)
+	{
+		return schedule_for(tenant, make_packaged_task(std::forward<Fn>(fn)), p);
+	}
+
+	rate_limiter_stats stats() const
+	{
+		std::lock_guard<std::mutex> lk(m_bucket->mutex);
+		return{ m_bucket->admitted, m_bucket->held_count, m_bucket->released,
+			m_bucket->releases, m_bucket->held.size() };
+	}
+
+private:
+	//Shared with the pending timer callback, which may outlive the limiter
+	struct bucket
+	{
+		bucket(Executor_base& exec, TimerQueue& t, const RateLimitOptions& opt) :
+			executor(exec), timer(t),
+			rate(opt.tokens_per_second > 0 ? opt.tokens_per_second : 1),
+			burst(std::max(opt.burst, 1.0)),
+			interval(opt.release_interval),
+			tokens(burst), refilled(clock::now()), last_release(refilled - interval)
+		{}
+
+		struct held_task
+		{
+			std::unique_ptr<Executable> exe;
+			tenant_id tenant;
+		};
+
+		static void submit(const std::shared_ptr<bucket>& self, std::unique_ptr<Executable> exe,
+			tenant_id tenant)
+		{
+			{
+				std::lock_guard<std::mutex> lk(self->mutex);
+				self->refill(clock::now());
+
+				//Queued tasks go first, or a steady trickle would starve them
+				if (!self->held.empty() || self->tokens < 1)
+				{
+					self->held.push_back({ std::move(exe), tenant });
+					++self->held_count;
+					if (!self->armed)
+						arm(self);
+					return;
+				}
+
+				self->tokens -= 1;
+				++self->admitted;
+			}
+			self->executor.post(std::move(exe), tenant);
+		}
+
+		//mutex must be held. Wakes up once a token is there, but no sooner
+		//than interval after the previous release, so tokens pile up
+		static void arm(const std::shared_ptr<bucket>& self)
+		{
+			auto missing = std::chrono::duration<double>((1 - self->tokens) / self->rate);
+			auto deadline = std::max(self->refilled + std::chrono::duration_cast<clock::duration>(missing),
+				self->last_release + self->interval);
+
+			std::weak_ptr<bucket> weak = self;
+			self->armed = true;
+			self->timer.call_at(deadline, [weak]
+			{
+				if (auto s = weak.lock())
+					release(s);
+			});
+		}
+
+		static void release(const std::shared_ptr<bucket>& self)
+		{
+			std::vector<held_task> batch;
+			{
+				std::lock_guard<std::mutex> lk(self->mutex);
+				self->armed = false;
+
+				auto now = clock::now();
+				self->refill(now);
+				size_t count = std::min(static_cast<size_t>(self->tokens), self->held.size());
+				take(*self, batch, count);
+				self->tokens -= static_cast<double>(count);
+
+				if (count != 0)
+				{
+					self->last_release = now;
+					++self->releases;
+				}
+				if (!self->held.empty())
+					arm(self);
+			}
+
+			self->post(batch);
+		}
+
+		void flush()
+		{
+			std::vector<held_task> batch;
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				take(*this, batch, held.size());
+			}
+			post(batch);
+		}
+
+		//A single queue lock and wake up pass per run of tasks of the same
+		//tenant, usually the whole batch
+		void post(std::vector<held_task>& batch)
+		{
+			for (size_t first = 0; first < batch.size();)
+			{
+				tenant_id tenant = batch[first].tenant;
+				std::vector<std::unique_ptr<Executable>> run;
+				for (; first < batch.size() && batch[first].tenant == tenant; ++first)
+					run.push_back(std::move(batch[first].exe));
+				executor.post(std::move(run), tenant);
+			}
+		}
+
+		//mutex must be held
+		static void take(bucket& b, std::vector<held_task>& out, size_t count)
+		{
+			out.reserve(count);
+			for (size_t x = 0; x < count; ++x)
+			{
+				out.push_back(std::move(b.held.front()));
+				b.held.pop_front();
+			}
+			b.released += count;
+		}
+
+		//mutex must be held
+		void refill(clock::time_point now)
+		{
+			std::chrono::duration<double> elapsed = now - refilled;
+			tokens = std::min(burst, tokens + elapsed.count() * rate);
+			refilled = now;
+		}
+
+		Executor_base& executor;
+		TimerQueue& timer;
+		const double rate;
+		const double burst;
+		const clock::duration interval;
+
+		mutable std::mutex mutex;
+		double tokens;
+		clock::time_point refilled;
+		clock::time_point last_release;
+		std::deque<held_task> held;
+		bool armed = false;
+
+		std::uint64_t admitted = 0;
+		std::uint64_t held_count = 0;
+		std::uint64_t released = 0;
+		std::uint64_t releases = 0;
+	};
+
+	std::shared_ptr<bucket> m_bucket;
+};
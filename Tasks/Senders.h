@@ -0,0 +1,415 @@
+#pragma once
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <typeinfo>
+#include <type_traits>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+///Lazy pipelines in the style of P2300 senders. A pipeline is one concrete
+///type describing every step; nothing runs until it is started, and then
+///the whole chain of receivers lives inside a single Executable, allocated
+///once and queued once. Steps call each other directly, so the compiler can
+///inline across them (no std::function, no virtual call between steps).
+///
+///	using namespace senders;
+///	auto f = start(schedule(pool) | then([] { return load(); })
+///		| bulk(n, [](size_t i, data& d) { d.process(i); })
+///		| then([](data d) { return d.sum(); }));
+///
+///bulk(n, fn) calls fn(i, value) (or fn(i) after a void step) for every i
+///in [0, n), spread over the executor's workers, then passes the value on.
+///It is the only step that allocates: its shared state and one Executable
+///per extra worker.
+///
+///There is no error channel: like the rest of the library, an exception
+///thrown by a step escapes the worker running it.
+namespace senders
+{
+	namespace impl
+	{
+		//Turns "a void step" and "a step producing T" into the same call
+		template <class Fn, class... V>
+		using step_result_t = std::invoke_result_t<Fn&, V...>;
+
+		template <class Fn, class Next, class... V>
+		void invoke_into(Fn& fn, Next& next, V&&... v)
+		{
+			if constexpr (std::is_void<step_result_t<Fn, V...>>::value)
+			{
+				fn(std::forward<V>(v)...);
+				next.set_value();
+			}
+			else
+				next.set_value(fn(std::forward<V>(v)...));
+		}
+
+		template <class T>
+		struct value_args { template <class Fn> using result = step_result_t<Fn, T>; };
+
+		template <>
+		struct value_args<void> { template <class Fn> using result = step_result_t<Fn>; };
+
+		//Receivers
+
+		template <class Fn, class Next>
+		struct then_receiver
+		{
+			Fn fn;
+			Next next;
+
+			template <class... V>
+			void set_value(V&&... v) { invoke_into(fn, next, std::forward<V>(v)...); }
+		};
+
+		template <class T>
+		struct promise_receiver
+		{
+			TaskPromise<T> promise;
+
+			template <class... V>
+			void set_value(V&&... v) { promise.set_value(std::forward<V>(v)...); }
+		};
+
+		struct detached_receiver
+		{
+			template <class... V>
+			void set_value(V&&...) {}
+		};
+
+		using clock = std::chrono::steady_clock;
+
+		//Parallel chunks shorter than this cost more to queue than they save
+		constexpr std::chrono::microseconds min_chunk_runtime{ 10 };
+
+		//Lives from the value reaching bulk until the last chunk is done,
+		//which hands the value on
+		template <class T, class Fn, class Next>
+		struct bulk_state
+		{
+			T value;
+			Fn fn;
+			Next next;
+			size_t count;
+			size_t chunks;
+			std::atomic<size_t> remaining;
+			Executor_base* timing; //records fn's runtime
+
+			void run_chunk(size_t chunk)
+			{
+				size_t first = count * chunk / chunks, last = count * (chunk + 1) / chunks;
+				auto start = timing != nullptr ? clock::now() : clock::time_point{};
+				for (size_t i = first; i < last; ++i)
+					fn(i, value);
+				if (timing != nullptr)
+					timing->record_loop(typeid(Fn), last - first, clock::now() - start);
+
+				if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					std::unique_ptr<bulk_state> self(this);
+					next.set_value(std::move(value));
+				}
+			}
+		};
+
+		template <class Fn, class Next>
+		struct bulk_state<void, Fn, Next>
+		{
+			Fn fn;
+			Next next;
+			size_t count;
+			size_t chunks;
+			std::atomic<size_t> remaining;
+			Executor_base* timing; //records fn's runtime
+
+			void run_chunk(size_t chunk)
+			{
+				size_t first = count * chunk / chunks, last = count * (chunk + 1) / chunks;
+				auto start = timing != nullptr ? clock::now() : clock::time_point{};
+				for (size_t i = first; i < last; ++i)
+					fn(i);
+				if (timing != nullptr)
+					timing->record_loop(typeid(Fn), last - first, clock::now() - start);
+
+				if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					std::unique_ptr<bulk_state> self(this);
+					next.set_value();
+				}
+			}
+		};
+
+		template <class State>
+		class bulk_chunk final : public Executable
+		{
+		public:
+			bulk_chunk(State& state, size_t chunk, Priority p) :
+				Executable(p, typeid(bulk_chunk)), m_state(state), m_chunk(chunk) {}
+
+			void execute() override { m_state.run_chunk(m_chunk); }
+
+		private:
+			State& m_state;
+			size_t m_chunk;
+		};
+
+		template <class T, class Fn, class Next>
+		struct bulk_receiver
+		{
+			Fn fn;
+			Next next;
+			size_t count;
+			Executor_base* executor;
+			Priority priority;
+
+			template <class... V>
+			void set_value(V&&... v)
+			{
+				//One chunk per worker; this thread takes the first one
+				size_t workers = executor != nullptr ? executor->worker_count() : 1;
+				if (workers == 0)
+					workers = std::max(1u, std::thread::hardware_concurrency());
+				size_t chunks = std::max<size_t>(std::min(count, workers), 1);
+
+				//Once fn was measured, no chunk shorter than min_chunk_runtime
+				bool timed = executor != nullptr && executor->tracks_runtimes();
+				if (timed)
+				{
+					auto expected = executor->expected_loop_runtime(typeid(Fn), count);
+					if (expected.count() != 0)
+						chunks = std::min<size_t>(chunks, std::max<std::chrono::nanoseconds::rep>(
+							expected / std::chrono::nanoseconds(min_chunk_runtime), 1));
+				}
+
+				using State = bulk_state<T, Fn, Next>;
+				State* state = new State{ std::forward<V>(v)..., std::move(fn), std::move(next),
+					count, chunks, {}, timed ? executor : nullptr };
+				state->remaining.store(chunks, std::memory_order_relaxed);
+
+				if (chunks > 1)
+				{
+					std::vector<std::unique_ptr<Executable>> batch;
+					batch.reserve(chunks - 1);
+					for (size_t c = 1; c < chunks; ++c)
+						batch.push_back(std::make_unique<bulk_chunk<State>>(*state, c, priority));
+					executor->post(std::move(batch));
+				}
+				state->run_chunk(0);
+			}
+		};
+
+		//The single allocation of a pipeline started by schedule()
+		template <class Receiver>
+		class schedule_op final : public Executable
+		{
+		public:
+			schedule_op(Receiver&& r, Priority p) :
+				Executable(p, typeid(schedule_op)), m_receiver(std::move(r)) {}
+
+			void execute() override { m_receiver.set_value(); }
+
+		private:
+			Receiver m_receiver;
+		};
+
+		//Same, for a pipeline continuing a TaskFuture: queued as its continuation
+		template <class Res, class Receiver>
+		class future_op final : public Executable
+		{
+		public:
+			future_op(TaskFuture<Res>&& f, Receiver&& r, Priority p) :
+				Executable(p, typeid(future_op)), m_future(std::move(f)), m_receiver(std::move(r)) {}
+
+			void execute() override
+			{
+				if constexpr (std::is_void<Res>::value)
+				{
+					m_future.get();
+					m_receiver.set_value();
+				}
+				else
+					m_receiver.set_value(m_future.get());
+			}
+
+		private:
+			TaskFuture<Res> m_future;
+			Receiver m_receiver;
+		};
+	} // namespace impl
+
+	//Senders. Each one knows its value type, and the executor and priority
+	//the pipeline runs with
+
+	class schedule_sender
+	{
+	public:
+		using value_type = void;
+
+		schedule_sender(Executor_base& executor, Priority p) : m_executor(&executor), m_priority(p) {}
+
+		Executor_base* executor() const { return m_executor; }
+		Priority priority() const { return m_priority; }
+
+		template <class Receiver>
+		void submit(Receiver&& r) &&
+		{
+			m_executor->post(std::make_unique<impl::schedule_op<std::decay_t<Receiver>>>(
+				std::forward<Receiver>(r), m_priority));
+		}
+
+	private:
+		Executor_base* m_executor;
+		Priority m_priority;
+	};
+
+	template <class Res>
+	class future_sender
+	{
+	public:
+		using value_type = Res;
+
+		future_sender(TaskFuture<Res>&& f, Priority p) : m_future(std::move(f)), m_priority(p) {}
+
+		Executor_base* executor() const { return future_state_access::state(m_future)->executor_base(); }
+		Priority priority() const { return m_priority; }
+
+		template <class Receiver>
+		void submit(Receiver&& r) &&
+		{
+			auto state = future_state_access::state(m_future);
+			state->add_continuation(std::make_unique<impl::future_op<Res, std::decay_t<Receiver>>>(
+				std::move(m_future), std::forward<Receiver>(r), m_priority));
+		}
+
+	private:
+		TaskFuture<Res> m_future;
+		Priority m_priority;
+	};
+
+	template <class Prev, class Fn>
+	class then_sender
+	{
+	public:
+		using value_type = typename impl::value_args<typename Prev::value_type>::template result<Fn>;
+
+		then_sender(Prev&& prev, Fn&& fn) : m_prev(std::move(prev)), m_fn(std::move(fn)) {}
+
+		Executor_base* executor() const { return m_prev.executor(); }
+		Priority priority() const { return m_prev.priority(); }
+
+		template <class Receiver>
+		void submit(Receiver&& r) &&
+		{
+			std::move(m_prev).submit(impl::then_receiver<Fn, std::decay_t<Receiver>>{
+				std::move(m_fn), std::forward<Receiver>(r) });
+		}
+
+	private:
+		Prev m_prev;
+		Fn m_fn;
+	};
+
+	template <class Prev, class Fn>
+	class bulk_sender
+	{
+	public:
+		using value_type = typename Prev::value_type;
+
+		bulk_sender(Prev&& prev, size_t count, Fn&& fn) :
+			m_prev(std::move(prev)), m_count(count), m_fn(std::move(fn)) {}
+
+		Executor_base* executor() const { return m_prev.executor(); }
+		Priority priority() const { return m_prev.priority(); }
+
+		template <class Receiver>
+		void submit(Receiver&& r) &&
+		{
+			Executor_base* e = executor();
+			Priority p = priority();
+			std::move(m_prev).submit(impl::bulk_receiver<value_type, Fn, std::decay_t<Receiver>>{
+				std::move(m_fn), std::forward<Receiver>(r), m_count, e, p });
+		}
+
+	private:
+		Prev m_prev;
+		size_t m_count;
+		Fn m_fn;
+	};
+
+	//Pipeline steps, appended with operator|
+
+	template <class Fn>
+	struct then_closure { Fn fn; };
+
+	template <class Fn>
+	struct bulk_closure { size_t count; Fn fn; };
+
+	template <class Fn>
+	then_closure<std::decay_t<Fn>> then(Fn&& fn)
+	{
+		return{ std::forward<Fn>(fn) };
+	}
+
+	template <class Fn>
+	bulk_closure<std::decay_t<Fn>> bulk(size_t count, Fn&& fn)
+	{
+		return{ count, std::forward<Fn>(fn) };
+	}
+
+	template <class Sender, class Fn>
+	then_sender<std::decay_t<Sender>, Fn> operator| (Sender&& s, then_closure<Fn> c)
+	{
+		return{ std::decay_t<Sender>(std::forward<Sender>(s)), std::move(c.fn) };
+	}
+
+	template <class Sender, class Fn>
+	bulk_sender<std::decay_t<Sender>, Fn> operator| (Sender&& s, bulk_closure<Fn> c)
+	{
+		return{ std::decay_t<Sender>(std::forward<Sender>(s)), c.count, std::move(c.fn) };
+	}
+
+	//Entry points
+
+	//Starts on a worker of executor
+	inline schedule_sender schedule(Executor_base& executor, Priority p = MEDIUM)
+	{
+		return{ executor, p };
+	}
+
+	//Starts once future is ready, where its continuations run
+	template <class Res>
+	future_sender<Res> continue_after(TaskFuture<Res> future, Priority p = MEDIUM)
+	{
+		return{ std::move(future), p };
+	}
+
+	//Sinks
+
+	//Runs the pipeline, its final value resolves the future
+	template <class Sender>
+	TaskFuture<typename std::decay_t<Sender>::value_type> start(Sender&& s)
+	{
+		using Res = typename std::decay_t<Sender>::value_type;
+
+		TaskPromise<Res> promise;
+		TaskFuture<Res> future = promise.get_future();
+		future_state_access::state(future)->set_executor_base(s.executor());
+
+		std::decay_t<Sender>(std::forward<Sender>(s)).submit(
+			impl::promise_receiver<Res>{ std::move(promise) });
+		return future;
+	}
+
+	//Runs the pipeline, nobody waits for it
+	template <class Sender>
+	void start_detached(Sender&& s)
+	{
+		std::decay_t<Sender>(std::forward<Sender>(s)).submit(impl::detached_receiver{});
+	}
+} // namespace senders
@@ -0,0 +1,592 @@
+#pragma once
+///Cross-process executor: a lock-free ring of task descriptors living in a
+///POSIX shared memory segment. Every process that attaches to the same
+///segment can submit tasks and (with workers > 0) execute tasks submitted by
+///any participant. Completion is published through futex words inside the
+///segment. Linux only.
+#ifdef __linux__
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <typeindex>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+namespace impl
+{
+	//Shared (not private) futexes: the words live in a MAP_SHARED segment
+	inline void futex_wait(std::atomic<std::uint32_t>* word, std::uint32_t expected,
+		long timeout_ns)
+	{
+		timespec ts{ 0, timeout_ns };
+		syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAIT,
+			expected, &ts, nullptr, 0);
+	}
+
+	inline void futex_wake(std::atomic<std::uint32_t>* word, int count)
+	{
+		syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAKE,
+			count, nullptr, nullptr, 0);
+	}
+
+	//A zombie counts as dead: its parent may be the one waiting on its tasks
+	inline bool process_alive(std::int32_t pid)
+	{
+		if (kill(pid, 0) != 0 && errno == ESRCH)
+			return false;
+
+		char path[32];
+		std::snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+		FILE* f = std::fopen(path, "r");
+		if (f == nullptr)
+			return true; //no procfs: trust kill()
+
+		char line[512];
+		size_t n = std::fread(line, 1, sizeof(line) - 1, f);
+		std::fclose(f);
+		line[n] = 0;
+
+		//pid (comm) state ..., comm may contain anything but ends at the last ')'
+		const char* end = std::strrchr(line, ')');
+		return end == nullptr || end[1] == 0 || end[2] != 'Z';
+	}
+
+	static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t)
+		&& std::atomic<std::uint64_t>::is_always_lock_free,
+		"shared memory atomics must be address free");
+
+	struct shm_layout
+	{
+		static constexpr std::uint32_t magic = 0x54534b53; // "TSKS"
+		static constexpr std::uint32_t ring_size = 1024;   // power of two
+		static constexpr std::uint32_t slot_count = 1024;
+		static constexpr size_t payload_size = 112;
+		static constexpr size_t result_size = 112;
+		static constexpr std::uint32_t no_slot = 0xFFFFFFFF;
+
+		//The executing process reports failures through the slot state.
+		//slot_executor_died is set by the submitter's reaper
+		enum slot_state : std::uint32_t { slot_free, slot_pending, slot_done,
+			slot_unknown_function, slot_type_mismatch, slot_failed, slot_executor_died };
+
+		struct descriptor
+		{
+			std::uint32_t function_id;
+			std::uint32_t slot;
+			std::uint32_t arg_size;  //as the submitter sees the function,
+			std::uint32_t res_size;  //checked against the executor's registration
+			unsigned char payload[payload_size];
+		};
+
+		struct alignas(64) cell
+		{
+			std::atomic<std::uint64_t> sequence;
+			descriptor desc;
+		};
+
+		struct alignas(64) completion_slot
+		{
+			std::atomic<std::uint32_t> state;
+			std::atomic<std::int32_t> executor; //pid running the task, 0 until taken
+			std::uint32_t next_free;
+			unsigned char result[result_size];  //or the message of slot_failed
+		};
+
+		std::atomic<std::uint32_t> ready;
+
+		alignas(64) std::atomic<std::uint64_t> tail;
+		alignas(64) std::atomic<std::uint64_t> head;
+
+		//Workers sleep on submitted, reapers on completed
+		alignas(64) std::atomic<std::uint32_t> submitted;
+		std::atomic<std::uint32_t> sleeping_workers;
+		alignas(64) std::atomic<std::uint32_t> completed;
+		std::atomic<std::uint32_t> sleeping_reapers;
+
+		//Free completion slots: Treiber stack, (tag << 32) | index
+		alignas(64) std::atomic<std::uint64_t> free_slots;
+
+		cell ring[ring_size];
+		completion_slot slots[slot_count];
+
+		void initialize()
+		{
+			tail = 0;
+			head = 0;
+			submitted = 0;
+			sleeping_workers = 0;
+			completed = 0;
+			sleeping_reapers = 0;
+
+			for (std::uint32_t x = 0; x < ring_size; ++x)
+				ring[x].sequence.store(x, std::memory_order_relaxed);
+
+			for (std::uint32_t x = 0; x < slot_count; ++x)
+			{
+				slots[x].state.store(slot_free, std::memory_order_relaxed);
+				slots[x].next_free = x + 1 < slot_count ? x + 1 : no_slot;
+			}
+			free_slots = 0;
+
+			ready.store(magic, std::memory_order_release);
+		}
+
+		std::uint32_t acquire_slot()
+		{
+			auto head_word = free_slots.load(std::memory_order_acquire);
+			while (true)
+			{
+				auto index = static_cast<std::uint32_t>(head_word);
+				if (index == no_slot)
+					return no_slot;
+
+				auto tag = (head_word >> 32) + 1;
+				auto next = (tag << 32) | slots[index].next_free;
+				if (free_slots.compare_exchange_weak(head_word, next, std::memory_order_acq_rel))
+					return index;
+			}
+		}
+
+		void release_slot(std::uint32_t index)
+		{
+			slots[index].state.store(slot_free, std::memory_order_relaxed);
+			auto head_word = free_slots.load(std::memory_order_acquire);
+			while (true)
+			{
+				slots[index].next_free = static_cast<std::uint32_t>(head_word);
+				auto tag = (head_word >> 32) + 1;
+				if (free_slots.compare_exchange_weak(head_word, (tag << 32) | index,
+					std::memory_order_acq_rel))
+					return;
+			}
+		}
+
+		//Same sequence scheme as bounded_channel (Pipeline.h)
+		bool try_push(const descriptor& desc)
+		{
+			auto pos = tail.load(std::memory_order_relaxed);
+			while (true)
+			{
+				cell& c = ring[pos & (ring_size - 1)];
+				auto seq = c.sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<std::int64_t>(seq - pos);
+
+				if (diff == 0)
+				{
+					if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						c.desc = desc;
+						c.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+
+		bool try_pop(descriptor& desc)
+		{
+			auto pos = head.load(std::memory_order_relaxed);
+			while (true)
+			{
+				cell& c = ring[pos & (ring_size - 1)];
+				auto seq = c.sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<std::int64_t>(seq - (pos + 1));
+
+				if (diff == 0)
+				{
+					if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						desc = c.desc;
+						c.sequence.store(pos + ring_size, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	};
+} // namespace impl
+
+class SharedMemoryExecutor
+{
+	using layout = impl::shm_layout;
+
+public:
+	//Creates the segment /name, or attaches to it if another process did.
+	//workers local threads execute tasks from the shared ring (0: submit only)
+	SharedMemoryExecutor(const std::string& name, size_t workers)
+	{
+		bool creator = true;
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+		{
+			creator = false;
+			fd = shm_open(name.c_str(), O_RDWR, 0600);
+		}
+		if (fd < 0)
+			throw std::runtime_error("shm_open failed for " + name);
+
+		if (creator && ftruncate(fd, sizeof(layout)) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("ftruncate failed for " + name);
+		}
+
+		//The creator may not have sized the segment yet
+		struct stat st;
+		while (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(layout))
+			std::this_thread::yield();
+
+		void* mem = mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("mmap failed for " + name);
+
+		m_shm = static_cast<layout*>(mem);
+		if (creator)
+			m_shm->initialize();
+		else
+			while (m_shm->ready.load(std::memory_order_acquire) != layout::magic)
+				std::this_thread::yield();
+
+		for (size_t x = 0; x < workers; ++x)
+			m_workers.emplace_back(&SharedMemoryExecutor::work, this);
+		m_reaper = std::thread(&SharedMemoryExecutor::reap, this);
+	}
+
+	~SharedMemoryExecutor()
+	{
+		m_alive = false;
+		impl::futex_wake(&m_shm->submitted, INT_MAX);
+		impl::futex_wake(&m_shm->completed, INT_MAX);
+
+		for (auto&& worker : m_workers)
+			worker.join();
+		m_reaper.join();
+
+		//Nobody reaps from now on. Slots still pending stay allocated: a
+		//worker of another process may write them yet
+		for (auto&& d : m_outstanding)
+		{
+			if (m_shm->slots[d.slot].state.load(std::memory_order_acquire) != layout::slot_pending)
+				settle(d);
+			else
+				d.resolve(nullptr, std::make_exception_ptr(
+					std::runtime_error("SharedMemoryExecutor destroyed before the task completed")));
+		}
+
+		munmap(m_shm, sizeof(layout));
+	}
+
+	SharedMemoryExecutor(const SharedMemoryExecutor&) = delete;
+	SharedMemoryExecutor& operator= (const SharedMemoryExecutor&) = delete;
+
+	//Removes the name; attached processes keep their mapping
+	static void unlink(const std::string& name)
+	{
+		shm_unlink(name.c_str());
+	}
+
+	//Every participant must register the same ids before submitting or
+	//executing. Argument and result travel by value through the segment
+	template <class Res, class Arg>
+	void register_function(std::uint32_t id, Res(*fn)(const Arg&))
+	{
+		static_assert(std::is_trivially_copyable<Arg>::value && sizeof(Arg) <= layout::payload_size,
+			"arguments must be trivially copyable and fit in a descriptor");
+		static_assert(std::is_trivially_copyable<Res>::value && sizeof(Res) <= layout::result_size,
+			"results must be trivially copyable and fit in a completion slot");
+
+		std::lock_guard<std::mutex> lk(m_mutex);
+		m_functions.insert_or_assign(id, registered_function{ [fn](const unsigned char* payload, unsigned char* result)
+		{
+			Arg arg;
+			std::memcpy(&arg, payload, sizeof(Arg));
+			Res res = fn(arg);
+			std::memcpy(result, &res, sizeof(Res));
+		}, typeid(Res), typeid(Arg), sizeof(Res), sizeof(Arg) });
+	}
+
+	//Spins (yielding) while the ring or the completion slots are exhausted.
+	//Throws std::invalid_argument unless id is registered here with exactly
+	//Res and Arg; the executing process checks their sizes against its own
+	//registration, a mismatch or an unknown id there fails the future. So
+	//does an exception thrown by the function (as a std::runtime_error with
+	//its message) or the death of the process running it.
+	//NOTE: the future belongs to no Executor_base, .then() is not available
+	template <class Res, class Arg>
+	TaskFuture<Res> submit(std::uint32_t id, const Arg& arg)
+	{
+		static_assert(std::is_trivially_copyable<Arg>::value && sizeof(Arg) <= layout::payload_size,
+			"arguments must be trivially copyable and fit in a descriptor");
+
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			auto it = m_functions.find(id);
+			if (it == m_functions.end())
+				throw std::invalid_argument("function id " + std::to_string(id) + " is not registered");
+			if (it->second.res_type != typeid(Res) || it->second.arg_type != typeid(Arg))
+				throw std::invalid_argument("function id " + std::to_string(id)
+					+ " was registered with other argument or result types");
+		}
+
+		std::uint32_t slot;
+		while ((slot = m_shm->acquire_slot()) == layout::no_slot)
+			std::this_thread::yield();
+		m_shm->slots[slot].executor.store(0, std::memory_order_relaxed);
+		m_shm->slots[slot].state.store(layout::slot_pending, std::memory_order_relaxed);
+
+		TaskPromise<Res> promise;
+		TaskFuture<Res> future = promise.get_future();
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_outstanding.push_back({ slot, [p = std::move(promise)](const unsigned char* result,
+				std::exception_ptr error) mutable
+			{
+				if (error)
+				{
+					p.set_exception(std::move(error));
+					return;
+				}
+				Res res;
+				std::memcpy(&res, result, sizeof(Res));
+				p.set_value(res);
+			} });
+		}
+
+		layout::descriptor desc;
+		desc.function_id = id;
+		desc.slot = slot;
+		desc.arg_size = sizeof(Arg);
+		desc.res_size = sizeof(Res);
+		std::memcpy(desc.payload, &arg, sizeof(Arg));
+
+		while (!m_shm->try_push(desc))
+			std::this_thread::yield();
+
+		m_shm->submitted.fetch_add(1, std::memory_order_release);
+		if (m_shm->sleeping_workers.load(std::memory_order_acquire) != 0)
+			impl::futex_wake(&m_shm->submitted, 1);
+
+		return future;
+	}
+
+private:
+	static constexpr long poll_ns = 50 * 1000 * 1000;
+
+	void work()
+	{
+		layout::descriptor desc;
+		while (m_alive)
+		{
+			auto seen = m_shm->submitted.load(std::memory_order_acquire);
+			if (!m_shm->try_pop(desc))
+			{
+				m_shm->sleeping_workers.fetch_add(1);
+				if (m_shm->head.load() == m_shm->tail.load())
+					impl::futex_wait(&m_shm->submitted, seen, poll_ns);
+				m_shm->sleeping_workers.fetch_sub(1);
+				continue;
+			}
+
+			auto& slot = m_shm->slots[desc.slot];
+			slot.executor.store(static_cast<std::int32_t>(getpid()), std::memory_order_release);
+
+			std::function<void(const unsigned char*, unsigned char*)> fn;
+			auto state = layout::slot_done;
+			{
+				std::lock_guard<std::mutex> lk(m_mutex);
+				auto it = m_functions.find(desc.function_id);
+				if (it == m_functions.end())
+					state = layout::slot_unknown_function;
+				else if (it->second.arg_size != desc.arg_size || it->second.res_size != desc.res_size)
+					state = layout::slot_type_mismatch;
+				else
+					fn = it->second.call;
+			}
+
+			//fn writes the result last: on failure the buffer carries the message
+			if (fn)
+				try
+				{
+					fn(desc.payload, slot.result);
+				}
+				catch (const std::exception& e)
+				{
+					state = layout::slot_failed;
+					set_message(slot, e.what());
+				}
+				catch (...)
+				{
+					state = layout::slot_failed;
+					set_message(slot, "unknown exception");
+				}
+			slot.state.store(state, std::memory_order_release);
+
+			m_shm->completed.fetch_add(1, std::memory_order_release);
+			if (m_shm->sleeping_reapers.load(std::memory_order_acquire) != 0)
+				impl::futex_wake(&m_shm->completed, INT_MAX);
+		}
+	}
+
+	//Resolves the local promises of slots completed by any process
+	void reap()
+	{
+		std::vector<outstanding> done;
+		while (m_alive)
+		{
+			auto seen = m_shm->completed.load(std::memory_order_acquire);
+			{
+				std::lock_guard<std::mutex> lk(m_mutex);
+				for (size_t x = 0; x < m_outstanding.size();)
+				{
+					auto& slot = m_shm->slots[m_outstanding[x].slot];
+					if (slot.state.load(std::memory_order_acquire) != layout::slot_pending)
+					{
+						done.push_back(std::move(m_outstanding[x]));
+						m_outstanding[x] = std::move(m_outstanding.back());
+						m_outstanding.pop_back();
+					}
+					else
+						++x;
+				}
+			}
+
+			for (auto&& d : done)
+				settle(d);
+
+			if (done.empty())
+			{
+				m_shm->sleeping_reapers.fetch_add(1);
+				impl::futex_wait(&m_shm->completed, seen, poll_ns);
+				m_shm->sleeping_reapers.fetch_sub(1);
+				fail_dead_executors();
+			}
+			done.clear();
+		}
+	}
+
+	//A process that dies running a task never completes its slot: fail it
+	//here, the next pass settles it. A task popped but not yet claimed
+	//(or a recycled pid) escapes this check and keeps its future waiting
+	void fail_dead_executors()
+	{
+		std::vector<std::pair<std::int32_t, bool>> checked; //pid, alive
+		std::lock_guard<std::mutex> lk(m_mutex);
+		for (auto&& d : m_outstanding)
+		{
+			auto& slot = m_shm->slots[d.slot];
+			auto pid = slot.executor.load(std::memory_order_acquire);
+			if (pid == 0 || slot.state.load(std::memory_order_acquire) != layout::slot_pending)
+				continue;
+
+			auto it = std::find_if(checked.begin(), checked.end(),
+				[pid](const std::pair<std::int32_t, bool>& c) { return c.first == pid; });
+			if (it == checked.end())
+			{
+				checked.emplace_back(pid, impl::process_alive(pid));
+				it = std::prev(checked.end());
+			}
+
+			std::uint32_t expected = layout::slot_pending;
+			if (!it->second)
+				slot.state.compare_exchange_strong(expected, layout::slot_executor_died,
+					std::memory_order_acq_rel);
+		}
+	}
+
+	static void set_message(layout::completion_slot& slot, const char* what)
+	{
+		std::strncpy(reinterpret_cast<char*>(slot.result), what, layout::result_size - 1);
+		slot.result[layout::result_size - 1] = 0;
+	}
+
+	struct registered_function
+	{
+		std::function<void(const unsigned char*, unsigned char*)> call;
+		std::type_index res_type;
+		std::type_index arg_type;
+		std::uint32_t res_size;
+		std::uint32_t arg_size;
+	};
+
+	struct outstanding
+	{
+		std::uint32_t slot;
+		std::function<void(const unsigned char*, std::exception_ptr)> resolve;
+	};
+
+	//Sets the value, or the error reported by the executing process, and
+	//frees the slot
+	void settle(outstanding& d)
+	{
+		auto& slot = m_shm->slots[d.slot];
+		switch (slot.state.load(std::memory_order_acquire))
+		{
+		case layout::slot_done:
+			d.resolve(slot.result, nullptr);
+			break;
+		case layout::slot_failed:
+			d.resolve(nullptr, std::make_exception_ptr(std::runtime_error(
+				reinterpret_cast<const char*>(slot.result))));
+			break;
+		case layout::slot_executor_died:
+			d.resolve(nullptr, std::make_exception_ptr(std::runtime_error(
+				"the executing process died before completing the task")));
+			break;
+		case layout::slot_unknown_function:
+			d.resolve(nullptr, std::make_exception_ptr(std::runtime_error(
+				"function id not registered in the executing process")));
+			break;
+		default:
+			d.resolve(nullptr, std::make_exception_ptr(std::runtime_error(
+				"function registered with other argument or result sizes in the executing process")));
+			break;
+		}
+		m_shm->release_slot(d.slot);
+	}
+
+	layout* m_shm = nullptr;
+	std::atomic_bool m_alive{ true };
+
+	std::mutex m_mutex;
+	std::unordered_map<std::uint32_t, registered_function> m_functions;
+	std::vector<outstanding> m_outstanding;
+
+	std::vector<std::thread> m_workers;
+	std::thread m_reaper;
+};
+
+#endif // __linux__
@@ -0,0 +1,384 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+///One task of a workload trace. Times are relative to the start of the
+///simulation
+struct sim_task
+{
+	static constexpr size_t none = static_cast<size_t>(-1);
+
+	std::chrono::nanoseconds arrival{};
+	std::chrono::nanoseconds cost{};
+	Priority priority = MEDIUM;
+	Executor_base::tenant_id tenant = Executor_base::no_tenant;
+	size_t after = none; //index of an earlier task it is a continuation of
+};
+
+struct sim_task_result
+{
+	std::chrono::nanoseconds ready;  //arrived, and its antecedent is done
+	std::chrono::nanoseconds start;  //taken by a worker
+	std::chrono::nanoseconds finish;
+
+	std::chrono::nanoseconds wait() const { return start - ready; }
+};
+
+struct sim_wait_summary
+{
+	size_t count = 0;
+	std::chrono::nanoseconds mean{}, p99{}, max{};
+};
+
+struct simulation_report
+{
+	std::vector<sim_task_result> tasks; //in trace order
+	std::chrono::nanoseconds makespan{};
+	double utilization = 0;             //busy time / (workers * makespan)
+	size_t other_tasks = 0;             //not in the trace: continuations, timers' tasks...
+
+	sim_wait_summary wait;
+	std::map<unsigned, sim_wait_summary> wait_by_priority;
+	std::map<Executor_base::tenant_id, sim_wait_summary> wait_by_tenant;
+};
+
+inline std::ostream& operator<< (std::ostream& os, const simulation_report& r)
+{
+	using std::chrono::duration_cast;
+	using us = std::chrono::microseconds;
+	auto line = [&os](const sim_wait_summary& w)
+	{
+		os << w.count << " tasks, wait mean " << duration_cast<us>(w.mean).count()
+			<< "us p99 " << duration_cast<us>(w.p99).count()
+			<< "us max " << duration_cast<us>(w.max).count() << "us\n";
+	};
+
+	os << "makespan " << duration_cast<us>(r.makespan).count() << "us, utilization "
+		<< r.utilization << ", " << r.other_tasks << " other tasks\n";
+	line(r.wait);
+	for (auto&& p : r.wait_by_priority) { os << "  priority " << p.first << ": "; line(p.second); }
+	for (auto&& t : r.wait_by_tenant) { os << "  tenant " << t.first << ": "; line(t.second); }
+	return os;
+}
+
+///Single threaded executor with virtual time, for reproducible scheduling
+///experiments. workers virtual workers take tasks off the usual queue (so
+///priorities, resource classes and tenants apply as configured); a task's
+///code runs when its virtual cost has elapsed, so whatever it schedules or
+///makes ready appears at its finish time. Simultaneous events (finishes,
+///timers, arrivals) are ordered by a generator seeded with seed: the same
+///seed replays the same interleaving, other seeds explore other ones.
+///
+///	SimulationExecutor sim(42, 4);
+///	auto report = sim.simulate(SimulationExecutor::read_trace(file));
+///	std::cout << report;
+///
+///NOTE: tasks must not block on futures nobody has made ready yet, there is
+///no other thread to make them ready. Everything runs on the calling thread
+class SimulationExecutor : public Executor_base
+{
+	using _Base = Executor_base;
+
+public:
+	using duration = std::chrono::nanoseconds;
+
+	//cost_jitter: each cost is scaled by a seeded factor in [1 - jitter, 1 + jitter]
+	explicit SimulationExecutor(std::uint64_t seed, size_t workers = 1, double cost_jitter = 0) :
+		m_random(seed), m_workers(workers != 0 ? workers : 1), m_jitter(cost_jitter)
+	{
+		for (size_t x = m_workers; x-- != 0;)
+			m_idle.push_back(x);
+	}
+
+	duration now() const { return m_now; }
+
+	//Virtual cost of tasks that are not part of a trace (zero by default)
+	void set_cost_model(std::function<duration(const Executable&)> model)
+	{
+		m_cost_model = std::move(model);
+	}
+
+	//fn runs on the calling thread of run() once delay of virtual time passed
+	void call_after(duration delay, std::function<void()> fn)
+	{
+		event e;
+		e.fn = std::move(fn);
+		push(m_now + delay, std::move(e));
+	}
+
+	//Advances virtual time until no task or timer is left. Returns the
+	//number of tasks executed
+	size_t run()
+	{
+		size_t count = 0;
+		while (true)
+		{
+			dispatch();
+			if (m_events.empty())
+				return count;
+
+			auto first = m_events.begin();
+			m_now = first->first.time;
+			event e = std::move(first->second);
+			m_events.erase(first);
+
+			if (e.task)
+			{
+				m_idle.push_back(e.worker);
+				_Base::run_dequeued(std::move(e.task));
+				++count;
+			}
+			else
+				e.fn();
+		}
+	}
+
+	//Replays trace from now() and runs to completion, along with whatever
+	//the trace's tasks and earlier work lead to
+	simulation_report simulate(const std::vector<sim_task>& trace)
+	{
+		duration start = m_now;
+		m_busy = duration::zero();
+
+		std::vector<trace_entry> entries(trace.size());
+		for (size_t x = 0; x < trace.size(); ++x)
+		{
+			//Only earlier tasks can be antecedents, anything else is ignored
+			bool continuation = trace[x].after < x;
+			entries[x].pending = continuation ? 2 : 1;
+			if (continuation)
+				entries[trace[x].after].dependents.push_back(x);
+		}
+
+		trace_run run_state{ *this, trace, entries, start };
+		for (size_t x = 0; x < trace.size(); ++x)
+		{
+			event e;
+			e.fn = [&run_state, x] { run_state.satisfied(x); };
+			push(start + trace[x].arrival, std::move(e));
+		}
+
+		size_t executed = run();
+
+		simulation_report report;
+		duration last = start;
+		for (auto&& entry : entries)
+		{
+			report.tasks.push_back(entry.result);
+			last = std::max(last, entry.result.finish);
+		}
+		report.makespan = last - start;
+		report.other_tasks = executed - trace.size();
+		if (report.makespan > duration::zero())
+			report.utilization = static_cast<double>(m_busy.count())
+				/ (static_cast<double>(m_workers) * static_cast<double>(report.makespan.count()));
+
+		std::vector<duration> all;
+		std::map<unsigned, std::vector<duration>> by_priority;
+		std::map<tenant_id, std::vector<duration>> by_tenant;
+		for (size_t x = 0; x < trace.size(); ++x)
+		{
+			duration w = report.tasks[x].wait();
+			all.push_back(w);
+			by_priority[trace[x].priority].push_back(w);
+			if (trace[x].tenant != no_tenant)
+				by_tenant[trace[x].tenant].push_back(w);
+		}
+		report.wait = summarize(all);
+		for (auto&& p : by_priority)
+			report.wait_by_priority[p.first] = summarize(p.second);
+		for (auto&& t : by_tenant)
+			report.wait_by_tenant[t.first] = summarize(t.second);
+		return report;
+	}
+
+	//One task per line: arrival_us cost_us [priority [tenant [after]]],
+	//after being the 0 based line index of the antecedent task (-1: none).
+	//Empty lines and lines starting with # are skipped
+	static std::vector<sim_task> read_trace(std::istream& in)
+	{
+		std::vector<sim_task> trace;
+		std::string text;
+		while (std::getline(in, text))
+		{
+			if (text.empty() || text[0] == '#')
+				continue;
+
+			std::istringstream line(text);
+			long long arrival = 0, cost = 0, after = -1;
+			unsigned priority = MEDIUM;
+			long long tenant = -1;
+			if (!(line >> arrival >> cost))
+				continue;
+			line >> priority >> tenant >> after;
+
+			sim_task t;
+			t.arrival = std::chrono::microseconds(arrival);
+			t.cost = std::chrono::microseconds(cost);
+			t.priority = static_cast<Priority>(std::min(priority, 255u));
+			t.tenant = tenant < 0 ? no_tenant : static_cast<tenant_id>(tenant);
+			t.after = after < 0 ? sim_task::none : static_cast<size_t>(after);
+			trace.push_back(t);
+		}
+		return trace;
+	}
+
+private:
+	struct event
+	{
+		std::unique_ptr<Executable> task; //finishing on worker
+		size_t worker = 0;
+		std::function<void()> fn;         //timer or trace arrival
+	};
+
+	//Ties at the same time are broken by the seeded generator, then by
+	//creation order, which only matters if the generator repeats itself
+	struct event_key
+	{
+		duration time;
+		std::uint64_t shuffle;
+		std::uint64_t sequence;
+
+		bool operator<(const event_key& rhs) const
+		{
+			return std::tie(time, shuffle, sequence) < std::tie(rhs.time, rhs.shuffle, rhs.sequence);
+		}
+	};
+
+	struct trace_entry
+	{
+		size_t pending;             //arrival and antecedent still missing
+		std::vector<size_t> dependents;
+		sim_task_result result{};
+	};
+
+	struct trace_run;
+
+	class trace_exe final : public Executable
+	{
+	public:
+		trace_exe(trace_run& run, size_t index) :
+			Executable(run.trace[index].priority, typeid(trace_exe)), m_run(run), m_index(index) {}
+
+		void execute() override { m_run.finished(m_index); }
+
+		duration cost() const { return m_run.trace[m_index].cost; }
+		void started(duration at) { m_run.entries[m_index].result.start = at - m_run.start; }
+
+	private:
+		trace_run& m_run;
+		size_t m_index;
+	};
+
+	struct trace_run
+	{
+		SimulationExecutor& sim;
+		const std::vector<sim_task>& trace;
+		std::vector<trace_entry>& entries;
+		duration start;
+
+		void satisfied(size_t x)
+		{
+			if (--entries[x].pending != 0)
+				return;
+
+			entries[x].result.ready = sim.m_now - start;
+			sim.post(std::make_unique<trace_exe>(*this, x), trace[x].tenant);
+		}
+
+		void finished(size_t x)
+		{
+			entries[x].result.finish = sim.m_now - start;
+			for (size_t d : entries[x].dependents)
+				satisfied(d);
+		}
+	};
+
+	//Hands queued tasks to idle workers. Their code runs when they finish
+	void dispatch()
+	{
+		while (!m_idle.empty())
+		{
+			std::unique_ptr<Executable> task = _Base::dequeue_one();
+			if (!task)
+				return;
+
+			duration cost;
+			if (auto* t = dynamic_cast<trace_exe*>(task.get()))
+			{
+				t->started(m_now);
+				cost = t->cost();
+			}
+			else
+				cost = m_cost_model ? m_cost_model(*task) : duration::zero();
+			cost = jitter(cost);
+			m_busy += cost;
+
+			event e;
+			e.task = std::move(task);
+			e.worker = m_idle.back();
+			m_idle.pop_back();
+			push(m_now + cost, std::move(e));
+		}
+	}
+
+	duration jitter(duration cost)
+	{
+		if (m_jitter == 0 || cost == duration::zero())
+			return cost;
+
+		//By hand: the standard distributions differ between libraries, the
+		//engine doesn't
+		double unit = static_cast<double>(m_random() >> 11) * (1.0 / 9007199254740992.0);
+		double factor = 1 + m_jitter * (2 * unit - 1);
+		return duration(static_cast<duration::rep>(static_cast<double>(cost.count()) * std::max(factor, 0.0)));
+	}
+
+	void push(duration time, event&& e)
+	{
+		m_events.emplace(event_key{ time, m_random(), m_sequence++ }, std::move(e));
+	}
+
+	static sim_wait_summary summarize(std::vector<duration> waits)
+	{
+		sim_wait_summary s;
+		s.count = waits.size();
+		if (waits.empty())
+			return s;
+
+		std::sort(waits.begin(), waits.end());
+		duration total{};
+		for (auto w : waits)
+			total += w;
+		s.mean = total / static_cast<duration::rep>(waits.size());
+		s.p99 = waits[(waits.size() * 99 + 99) / 100 - 1]; //nearest rank
+		s.max = waits.back();
+		return s;
+	}
+
+	std::mt19937_64 m_random;
+	const size_t m_workers;
+	const double m_jitter;
+
+	duration m_now{};
+	duration m_busy{};
+	std::uint64_t m_sequence = 0;
+	std::map<event_key, event> m_events;
+	std::vector<size_t> m_idle;
+	std::function<duration(const Executable&)> m_cost_model;
+};
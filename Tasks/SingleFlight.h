@@ -0,0 +1,205 @@
+#pragma once
+#include <unordered_map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+struct SingleFlightOptions
+{
+	size_t cache_capacity = 0;  //completed results kept around (0: no cache)
+	std::chrono::steady_clock::duration ttl{}; //lifetime of a cached result (0: forever)
+	size_t shards = 16;         //independent locks in front of the executor (at most cache_capacity)
+};
+
+struct single_flight_stats
+{
+	size_t executed = 0; //tasks actually scheduled
+	size_t joined = 0;   //callers attached to a task in flight
+	size_t cached = 0;   //callers served from the result cache
+};
+
+///Deduplicates keyed computations in front of an executor. While a task
+///for a key is in flight, later callers get its SharedTaskFuture instead of
+///a new execution. Completed results may stay in a per shard LRU/TTL cache.
+///
+///	SingleFlight<std::string, Image> thumbs(pool, { 4096, std::chrono::minutes(5) });
+///	auto f = thumbs.schedule_keyed(url, [url] { return render(url); });
+///
+///NOTE: must outlive the tasks it scheduled
+template <class Key, class Res, class Hash = std::hash<Key>>
+class SingleFlight
+{
+	using clock = std::chrono::steady_clock;
+
+public:
+	SingleFlight(Executor_base& executor, const SingleFlightOptions& opt = SingleFlightOptions{}) :
+		m_executor(executor),
+		m_ttl(opt.ttl),
+		m_shard_count(shard_count(opt)),
+		m_shards(new shard[m_shard_count])
+	{
+		//Split the capacity exactly, every shard keeps at least one result
+		for (size_t x = 0; x < m_shard_count; ++x)
+			m_shards[x].capacity = opt.cache_capacity / m_shard_count
+				+ (x < opt.cache_capacity % m_shard_count ? 1 : 0);
+	}
+
+	SingleFlight(const SingleFlight&) = delete;
+	SingleFlight& operator= (const SingleFlight&) = delete;
+
+	//fn is only scheduled if no task for key is in flight or cached
+	template <class Fn>
+	SharedTaskFuture<Res> schedule_keyed(const Key& key, Fn&& fn, Priority p = MEDIUM)
+	{
+		static_assert(std::is_same<std::result_of_t<std::decay_t<Fn>()>, Res>::value,
+			"fn must take no arguments and return Res");
+
+		shard& s = shard_of(key);
+		std::lock_guard<std::mutex> lk(s.mutex);
+
+		auto it = s.entries.find(key);
+		if (it != s.entries.end())
+		{
+			entry& e = it->second;
+			if (!e.done)
+			{
+				++m_stats_joined;
+				return e.future;
+			}
+
+			if (m_ttl == clock::duration::zero() || clock::now() < e.expires)
+			{
+				s.lru.splice(s.lru.begin(), s.lru, e.lru_pos);
+				++m_stats_cached;
+				return e.future;
+			}
+
+			s.lru.erase(e.lru_pos);
+			s.entries.erase(it);
+		}
+
+		//Scheduling under the shard lock keeps joiners from racing a
+		//second execution; other shards are not held up
+		auto id = ++s.next_id;
+		auto future = m_executor.schedule(make_packaged_task(
+			[this, key, id, fn = std::forward<Fn>(fn)]() mutable -> Res
+		{
+			struct finish_guard
+			{
+				~finish_guard() { self->finished(key, id); }
+				SingleFlight* self;
+				const Key& key;
+				size_t id;
+			} guard{ this, key, id };
+
+			return fn();
+		}), p).share();
+
+		entry& e = s.entries[key];
+		e.future = future;
+		e.id = id;
+		++m_stats_executed;
+		return future;
+	}
+
+	//Drops the cached result, or detaches the flight so the next caller
+	//starts a fresh execution (current joiners still get the old result)
+	void invalidate(const Key& key)
+	{
+		shard& s = shard_of(key);
+		std::lock_guard<std::mutex> lk(s.mutex);
+
+		auto it = s.entries.find(key);
+		if (it == s.entries.end())
+			return;
+		if (it->second.done)
+			s.lru.erase(it->second.lru_pos);
+		s.entries.erase(it);
+	}
+
+	single_flight_stats stats() const
+	{
+		single_flight_stats res;
+		res.executed = m_stats_executed.load(std::memory_order_relaxed);
+		res.joined = m_stats_joined.load(std::memory_order_relaxed);
+		res.cached = m_stats_cached.load(std::memory_order_relaxed);
+		return res;
+	}
+
+private:
+	struct entry
+	{
+		SharedTaskFuture<Res> future;
+		size_t id = 0;
+		bool done = false;
+		clock::time_point expires;
+		typename std::list<Key>::iterator lru_pos;
+	};
+
+	struct alignas(64) shard
+	{
+		std::mutex mutex;
+		std::unordered_map<Key, entry, Hash> entries;
+		std::list<Key> lru; //completed entries, most recently used first
+		size_t capacity = 0;
+		size_t next_id = 0;
+	};
+
+	static size_t shard_count(const SingleFlightOptions& opt)
+	{
+		size_t count = opt.shards != 0 ? opt.shards : 1;
+		return opt.cache_capacity != 0 ? std::min(count, opt.cache_capacity) : count;
+	}
+
+	shard& shard_of(const Key& key)
+	{
+		return m_shards[Hash{}(key) % m_shard_count];
+	}
+
+	//Runs right before the task returns: a caller arriving in between gets
+	//a future that is about to become ready, which is just as good
+	void finished(const Key& key, size_t id)
+	{
+		shard& s = shard_of(key);
+		std::lock_guard<std::mutex> lk(s.mutex);
+
+		auto it = s.entries.find(key);
+		if (it == s.entries.end() || it->second.id != id)
+			return; //invalidated while in flight
+
+		if (s.capacity == 0)
+		{
+			s.entries.erase(it);
+			return;
+		}
+
+		entry& e = it->second;
+		e.done = true;
+		e.expires = clock::now() + m_ttl;
+		s.lru.push_front(key);
+		e.lru_pos = s.lru.begin();
+
+		while (s.lru.size() > s.capacity)
+		{
+			s.entries.erase(s.lru.back());
+			s.lru.pop_back();
+		}
+	}
+
+	Executor_base& m_executor;
+	const clock::duration m_ttl;
+	const size_t m_shard_count;
+	std::unique_ptr<shard[]> m_shards;
+
+	std::atomic<size_t> m_stats_executed{ 0 };
+	std::atomic<size_t> m_stats_joined{ 0 };
+	std::atomic<size_t> m_stats_cached{ 0 };
+};
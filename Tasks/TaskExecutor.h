@@ -1,13 +1,22 @@
 #pragma once
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <atomic>
 #include <functional>
 #include <memory>
 #include <typeinfo>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <utility>
 
 #include "TaskFuture.h"
 #include "priority_queue_threadsafe.h"
+#include "WorkerContext.h"
 #include "Task.h"
 
 enum Priority : unsigned char
@@ -24,27 +33,56 @@ enum Priority : unsigned char
 
 //Forward declarations from header file "TaskFuture.h". Solve circular dependency
 template <class> class TaskFuture;
+template <class> class SharedTaskFuture;
+template <class> class TaskFuture_Base;
 template <class, class...> class Task;
 template <class, class...> class PackagedTask;
 template <class, class...> struct task_data;
 template <class> class shared_state_base;
+template <class> class TaskPromise;
+class Executor_base;
+class priority_node;
 
 //Type erasure for TaskExe
 class Executable
 {
 public:
-	Executable (Priority p) : m_priority(p) {}
+	Executable (Priority p, const std::type_info& type = typeid(Executable)) : 
+		m_priority(p), m_type(&type) {}
 	virtual ~Executable() {}
 	virtual void execute() = 0;
 
+	Priority priority() const { return m_priority; }
+
+	//Concrete task type, captured at schedule time (reported by the watchdog)
+	const std::type_info& type() const { return *m_type; }
+
 protected:
 	Priority m_priority;
+	const std::type_info* m_type;
+
+private:
+	template<class T> friend class shared_state_base;
+	friend class Executor_base;
+
+	//Intrusive link, used while waiting in a list of continuations
+	Executable* m_next = nullptr;
+
+	//State this task fulfills (if any), lets waiters find it in the queue
+	priority_node* m_result = nullptr;
+
+	//Weighted fair queuing: virtual finish time, orders tasks of the same
+	//priority (0 for all of them when no tenant was added)
+	std::uint64_t m_tag = 0;
+	unsigned m_tenant = static_cast<unsigned>(-1);
 
 public:
 	//implement operator< for priority queue
 	bool operator<(const Executable& rhs) const
 	{
-		return rhs.m_priority < this->m_priority;
+		if (m_priority != rhs.m_priority)
+			return rhs.m_priority < this->m_priority;
+		return m_tag < rhs.m_tag;
 	}
 };
 
@@ -56,6 +94,9 @@ inline bool operator< (const std::unique_ptr<Executable>& lhs,
 	return (*rhs.get() < *lhs.get());
 }
 
+template <class Res, class... Args>
+class TaskExe;
+
 //Common parts for the various specializations
 template <class Res, class... Args>
 class TaskExe_base : public Executable
@@ -70,7 +111,7 @@ public:
 	TaskExe_base& operator= (const TaskExe_base&) = delete;
 
 	TaskExe_base(TaskExe_base&& other) : 
-		_Base(other.m_priority),
+		_Base(other.m_priority, other.type()),
 		m_task_data_ptr(std::move(other.m_task_data_ptr)) {}
 
 	TaskExe_base& operator=(TaskExe_base&& other)
@@ -82,8 +123,10 @@ public:
 		return *this;
 	}
 
+	//The callable's own type, not just the signature: it keys the runtime
+	//history and names the task in stall reports
 	explicit TaskExe_base(TaskDataHandle td, Priority p = MEDIUM) : 
-		Executable(p), 
+		Executable(p, td->task.target_type()), 
 		m_task_data_ptr(std::move(td)) {}
 
 protected:
@@ -127,31 +170,337 @@ public:
 
 };
 
+//What a worker is doing, as seen by the watchdog. Written by the worker with
+//relaxed stores only (no fences, no clock reads), and only while a watchdog
+//is enabled: the watchdog thread does the timing itself and tolerates a
+//slightly stale view
+struct alignas(64) worker_activity
+{
+	static constexpr std::uint64_t busy_bit = 1 << 8;
+
+	void begin(const Executable& task)
+	{
+		m_sequence += 1 << 9;
+		m_busy = true;
+		m_type.store(&task.type(), std::memory_order_relaxed);
+		m_state.store(m_sequence | busy_bit | task.priority(), std::memory_order_relaxed);
+	}
+
+	void idle()
+	{
+		m_busy = false;
+		m_state.store(m_sequence, std::memory_order_relaxed);
+	}
+
+	//Called instead of begin while no watchdog runs: a task published
+	//before the watchdog was disabled must not look stuck to the next one
+	void unwatched()
+	{
+		if (m_busy)
+			idle();
+	}
+
+	//(sequence << 9) | busy << 8 | priority
+	std::atomic<std::uint64_t> m_state{ 0 };
+	std::atomic<const std::type_info*> m_type{ nullptr };
+
+private:
+	std::uint64_t m_sequence = 0; //only touched by the worker
+	bool m_busy = false;
+};
+
+struct runtime_estimate
+{
+	const std::type_info* type;
+	std::chrono::nanoseconds mean; //moving average
+	std::uint64_t samples;
+};
+
+//Moving average of the runtime per task type (alpha 1/8, seeded with the
+//first sample). Fixed size and lock free; types beyond capacity are not
+//tracked. Racing updates may lose a sample, which an average can afford
+class runtime_history
+{
+public:
+	static constexpr size_t capacity = 256;
+
+	void record(const std::type_info& type, std::chrono::nanoseconds runtime)
+	{
+		slot* s = find(type, true);
+		if (s == nullptr)
+			return;
+
+		auto ns = static_cast<std::uint64_t>(std::max<std::chrono::nanoseconds::rep>(runtime.count(), 0));
+		auto old = s->mean.load(std::memory_order_relaxed);
+		bool first = s->samples.fetch_add(1, std::memory_order_relaxed) == 0;
+		s->mean.store(first ? ns : old - old / 8 + ns / 8, std::memory_order_relaxed);
+	}
+
+	//Zero for types never seen
+	std::chrono::nanoseconds estimate(const std::type_info& type) const
+	{
+		const slot* s = find(type, false);
+		return std::chrono::nanoseconds(s != nullptr ? s->mean.load(std::memory_order_relaxed) : 0);
+	}
+
+	std::vector<runtime_estimate> snapshot() const
+	{
+		std::vector<runtime_estimate> res;
+		for (auto&& s : m_slots)
+		{
+			auto samples = s.samples.load(std::memory_order_relaxed);
+			if (samples != 0)
+				res.push_back({ s.type.load(std::memory_order_acquire),
+					std::chrono::nanoseconds(s.mean.load(std::memory_order_relaxed)), samples });
+		}
+		return res;
+	}
+
+private:
+	struct slot
+	{
+		std::atomic<const std::type_info*> type{ nullptr };
+		std::atomic<std::uint64_t> mean{ 0 };
+		std::atomic<std::uint64_t> samples{ 0 };
+	};
+
+	//Linear probing from the type's hash. Slots are claimed, never freed
+	slot* find(const std::type_info& type, bool claim) const
+	{
+		size_t first = type.hash_code() % capacity;
+		for (size_t x = 0; x < capacity; ++x)
+		{
+			slot& s = m_slots[(first + x) % capacity];
+			const std::type_info* t = s.type.load(std::memory_order_acquire);
+			if (t == nullptr)
+			{
+				if (!claim)
+					return nullptr;
+				if (s.type.compare_exchange_strong(t, &type, std::memory_order_acq_rel))
+					return &s;
+			}
+			if (*t == type)
+				return &s;
+		}
+		return nullptr;
+	}
+
+	mutable slot m_slots[capacity];
+};
+
+//Gives fn a type of its own, so its runtime is tracked apart from other
+//tasks of the same type (function pointers, std::function...):
+//	pool.schedule(cost_tag<struct decode_tag>(&decode_frame));
+template <class Tag, class Fn>
+struct cost_tagged
+{
+	Fn fn;
+	decltype(auto) operator()() { return fn(); }
+};
+
+template <class Tag, class Fn>
+cost_tagged<Tag, std::decay_t<Fn>> cost_tag(Fn&& fn)
+{
+	return{ std::forward<Fn>(fn) };
+}
+
+struct tenant_metrics
+{
+	unsigned weight;
+	size_t queued;          //tasks waiting in the queue
+	std::uint64_t started;  //tasks dequeued so far
+};
+
+struct stall_report
+{
+	size_t worker; //meaningless if pool_stalled
+	const std::type_info* task_type;
+	Priority priority;
+	std::chrono::steady_clock::duration duration;
+	bool pool_stalled; //queue not empty and no worker made progress
+};
+
+//Executes the same callable over a group of argument tuples, resolving
+//one promise per call. Created by Executor_base::schedule_batched
+template <class Fn, class Res, class... Args>
+class TaskBatchExe final : public Executable
+{
+public:
+	TaskBatchExe(Fn fn, std::vector<std::tuple<Args...>>&& arguments, Priority p) :
+		Executable(p, typeid(TaskBatchExe)),
+		m_fn(std::move(fn)),
+		m_arguments(std::move(arguments)),
+		m_promises(m_arguments.size()) {}
+
+	size_t size() const { return m_arguments.size(); }
+	std::vector<TaskPromise<Res>>& promises() { return m_promises; }
+
+	void execute() override
+	{
+		for (size_t x = 0; x < m_arguments.size(); ++x)
+			execute_one(m_promises[x], std::move(m_arguments[x]));
+	}
+
+private:
+	template <class R = Res>
+	std::enable_if_t<!std::is_same<R, void>::value>
+	execute_one(TaskPromise<Res>& promise, std::tuple<Args...>&& args)
+	{
+		promise.set_value(move_apply(m_fn, std::move(args)));
+	}
+
+	template <class R = Res>
+	std::enable_if_t<std::is_same<R, void>::value>
+	execute_one(TaskPromise<Res>& promise, std::tuple<Args...>&& args)
+	{
+		move_apply(m_fn, std::move(args));
+		promise.set_value();
+	}
+
+	Fn m_fn;
+	std::vector<std::tuple<Args...>> m_arguments;
+	std::vector<TaskPromise<Res>> m_promises;
+};
+
+//Priority inheritance. Every future's shared state knows the executor and
+//priority of the task that will fulfill it, and the state that task is a
+//continuation of. A waiter with a higher priority raises the task in the
+//queue (or the priority it will be queued with, for continuations still
+//parked) and then its antecedents, recursively
+class priority_node
+{
+public:
+	//Cheap unless p is higher than anything seen so far
+	void inherit_priority(Priority p);
+
+	Priority inherited_priority() const
+	{
+		return static_cast<Priority>(m_priority.load(std::memory_order_relaxed));
+	}
+
+protected:
+	//The value is there, nobody needs boosting anymore
+	void settle() { m_settled.store(true, std::memory_order_relaxed); }
+
+	//Continuations are queued on behalf of the tenant of the task
+	//producing the value
+	unsigned producer_tenant() const { return m_tenant; }
+
+private:
+	friend class Executor_base;
+
+	//Set before the future is handed out, read only afterwards
+	Executor_base* m_executor = nullptr;
+	std::weak_ptr<priority_node> m_antecedent;
+
+	std::atomic<unsigned char> m_priority{ 0 };
+	std::atomic_bool m_settled{ false };
+
+	//Set when the producing task is queued, read when it sets the value
+	unsigned m_tenant = static_cast<unsigned>(-1);
+};
+
+//Installed by fiber workers (see FiberExecutor.h) while a fiber runs on
+//the thread. A wait() on a fiber suspends it instead of blocking the thread
+class fiber_hook
+{
+public:
+	static fiber_hook*& current()
+	{
+		static thread_local fiber_hook* hook = nullptr;
+		return hook;
+	}
+
+	//Switches away from the calling fiber. Once it is off its stack,
+	//add_wake gets the Executable that resumes it (priority p), to be
+	//attached as a continuation of whatever the fiber waits for
+	virtual void suspend(Priority p,
+		const std::function<void(std::unique_ptr<Executable>)>& add_wake) = 0;
+
+protected:
+	~fiber_hook() {}
+};
+
 //Base class for TaskExecutor and TaskExecutorPool.
 //Implements common parts
 class Executor_base
 {
 public:
+	Executor_base()
+	{
+		std::fill(std::begin(m_class_of), std::end(m_class_of), no_class);
+	}
+
 	template <class Res, class... Args>
 	TaskFuture<Res> schedule(PackagedTask<Res(Args...)>&& task, Priority p = MEDIUM)
+	{
+		return schedule_as(no_tenant, std::move(task), p);
+	}
+
+	using tenant_id = unsigned;
+	static constexpr tenant_id no_tenant = static_cast<tenant_id>(-1);
+
+	//Tenants get a share of the executor proportional to their weight among
+	//the tasks of the same priority, whatever the number of tasks each one
+	//queues. Add them before scheduling
+	tenant_id add_tenant(unsigned weight = 1)
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+		m_tenants.emplace_back(new tenant_state(weight != 0 ? weight : 1));
+		m_fair = true;
+		return static_cast<tenant_id>(m_tenants.size() - 1);
+	}
+
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule_for(tenant_id tenant, PackagedTask<Res(Args...)>&& task, Priority p = MEDIUM)
+	{
+		return schedule_as(tenant, std::move(task), p);
+	}
+
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule_for(tenant_id tenant, PackagedTask<Res(Args...)>& task, Priority p = MEDIUM)
+	{
+		return schedule_as(tenant, std::move(task), p);
+	}
+
+	template <class Fn>
+	decltype(auto) schedule_for(tenant_id tenant, Fn&& fn, Priority p = MEDIUM)
+	{
+		return schedule_for(tenant, make_packaged_task(std::forward<Fn>(fn)), p);
+	}
+
+	tenant_metrics tenant_stats(tenant_id tenant) const
+	{
+		const tenant_state& t = *m_tenants.at(tenant);
+		return{ t.weight, t.queued.load(std::memory_order_relaxed),
+			t.started.load(std::memory_order_relaxed) };
+	}
+
+private:
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule_as(tenant_id tenant, PackagedTask<Res(Args...)>&& task, Priority p)
 	{
 		//Get hold of the handle to task_data and obtain the future
 		auto task_data_ptr = task.get_data_handle();
 		TaskFuture<Res> future = task_data_ptr->promise.get_future();
 
+		//Set the executor_base in the future, so .then() can be implemented.
+		//Done before enqueuing, the task may complete right away
+		future.set_executor_base(this);
+
 		//Move the handle into a TaskExe and enque it
-		m_queue.enqueue( std::make_unique<TaskExe<Res, Args...>>
-			(std::move(task_data_ptr), p));
+		auto exe = std::make_unique<TaskExe<Res, Args...>>(std::move(task_data_ptr), p);
+		link_producer(*exe, future, p);
+		stamp(*exe, tenant);
+		m_queue.enqueue(std::move(exe));
 
 		//If a thread is asleep and waiting, wake it up
-		m_cv.notify_one();
-
-		//Set the executor_base in the future, so .then() can be implemented
-		future.set_executor_base(this);
+		notify_one_thread();
 
 		return future;
 	}
 
+public:
 	//moves the task to the schedule implementation. Used to avoid having to use
 	//std::move every time schedule is called. Task becomes invalid either way.
 	template <class Res, class... Args>
@@ -166,7 +515,149 @@ public:
 	template <class Fn>
 	decltype(auto) schedule(Fn&& fn, Priority p = MEDIUM)
 	{
-		return schedule(std::move(make_packaged_task(std::forward<Fn>(fn))));
+		return schedule(std::move(make_packaged_task(std::forward<Fn>(fn))), p);
+	}
+
+	//Fire and forget: queues a ready-made Executable, no future involved
+	void post(std::unique_ptr<Executable> exe, tenant_id tenant = no_tenant)
+	{
+		stamp(*exe, tenant);
+		m_queue.enqueue(std::move(exe));
+		notify_one_thread();
+	}
+
+	//Same, for many of them under one queue lock and one wake up pass
+	void post(std::vector<std::unique_ptr<Executable>> batch, tenant_id tenant = no_tenant)
+	{
+		Executable* list = nullptr;
+		for (auto it = batch.rbegin(); it != batch.rend(); ++it)
+		{
+			(*it)->m_next = list;
+			list = it->release();
+		}
+		if (list != nullptr)
+			m_schedule_continuations(list, tenant);
+	}
+
+	//Builds the Executable schedule would queue, without queuing it: the
+	//caller decides when to post it. The future is valid right away
+	template <class Res, class... Args>
+	std::pair<TaskFuture<Res>, std::unique_ptr<Executable>>
+		package(PackagedTask<Res(Args...)>&& task, Priority p = MEDIUM)
+	{
+		auto task_data_ptr = task.get_data_handle();
+		TaskFuture<Res> future = task_data_ptr->promise.get_future();
+		future.set_executor_base(this);
+
+		std::unique_ptr<Executable> exe =
+			std::make_unique<TaskExe<Res, Args...>>(std::move(task_data_ptr), p);
+		link_producer(*exe, future, p);
+
+		return{ std::move(future), std::move(exe) };
+	}
+
+	//Lazy launch: nothing is queued until the result is demanded through
+	//the future (get/wait run it inline, wait_for/then/kick() enqueue it).
+	//If the future is destroyed untouched the task never runs
+	template <class Res, class... Args>
+	TaskFuture<Res> schedule_deferred(PackagedTask<Res(Args...)>&& task, Priority p = MEDIUM)
+	{
+		auto task_data_ptr = task.get_data_handle();
+		TaskFuture<Res> future = task_data_ptr->promise.get_future();
+		future.set_executor_base(this);
+
+		auto exe = std::make_unique<TaskExe<Res, Args...>>(std::move(task_data_ptr), p);
+		link_producer(*exe, future, p);
+		future.m_state_ptr->set_deferred(std::move(exe));
+
+		return future;
+	}
+
+	template <class Fn>
+	decltype(auto) schedule_deferred(Fn&& fn, Priority p = MEDIUM)
+	{
+		return schedule_deferred(make_packaged_task(std::forward<Fn>(fn)), p);
+	}
+
+	//Runs fn once per argument tuple, all inside a single executable, so the
+	//queue, wake up and execute overhead is paid once for the whole group.
+	//Each call still resolves its own future
+	template <class Fn, class... Args>
+	auto schedule_batched(Fn fn, std::vector<std::tuple<Args...>> arguments, Priority p = MEDIUM)
+	{
+		using Res = std::result_of_t<Fn(Args...)>;
+		auto exe = std::make_unique<TaskBatchExe<Fn, Res, Args...>>(
+			std::move(fn), std::move(arguments), p);
+
+		std::vector<TaskFuture<Res>> futures;
+		futures.reserve(exe->size());
+		for (auto&& promise : exe->promises())
+		{
+			futures.push_back(promise.get_future());
+			futures.back().set_executor_base(this);
+		}
+
+		stamp(*exe, no_tenant);
+		m_queue.enqueue(std::move(exe));
+		notify_one_thread();
+
+		return futures;
+	}
+
+	//Opt-in coalescing: a worker dequeues up to max_batch queued tasks of the
+	//same priority under one lock and runs them back to back. Good for tiny
+	//tasks, but a batch is no longer available to the other workers. With
+	//runtimes tracked, a batch also stops once its expected runtime reaches
+	//budget, so a few long tasks don't get stuck behind each other
+	void set_batch_dequeue(size_t max_batch,
+		std::chrono::nanoseconds budget = std::chrono::microseconds(100))
+	{
+		m_max_batch = max_batch == 0 ? 1 : max_batch;
+		m_batch_budget = budget;
+	}
+
+	enum class cost_mode
+	{
+		off,            //nothing measured (default)
+		track,          //runtime history only
+		shortest_first  //history, and shorter expected runtime first within a priority
+	};
+
+	//Configure before scheduling. Tracking costs two clock reads per task.
+	//shortest_first may starve long tasks under a steady flow of short ones
+	//of the same priority; with tenants, expected runtimes replace the unit
+	//cost of fair queuing instead
+	void set_cost_mode(cost_mode mode)
+	{
+		m_cost_mode = mode;
+	}
+
+	//Zero until a task of that type ran with tracking on
+	std::chrono::nanoseconds expected_runtime(const std::type_info& type) const
+	{
+		return m_runtimes.estimate(type);
+	}
+
+	//Parallel loops measure their body themselves, keyed by its type, to
+	//pick grain sizes (see ColumnBatch, senders::bulk). Kept per 64
+	//iterations, a single one may well take less than a nanosecond
+	void record_loop(const std::type_info& body, size_t iterations, std::chrono::nanoseconds runtime)
+	{
+		if (iterations != 0)
+			m_runtimes.record(body, runtime * loop_step / static_cast<std::chrono::nanoseconds::rep>(iterations));
+	}
+
+	std::chrono::nanoseconds expected_loop_runtime(const std::type_info& body, size_t iterations) const
+	{
+		return m_runtimes.estimate(body) * static_cast<std::chrono::nanoseconds::rep>(iterations) / loop_step;
+	}
+
+	bool tracks_runtimes() const { return m_cost_mode != cost_mode::off; }
+
+	//Metrics snapshot: the runtime estimate of every type seen so far
+	std::vector<runtime_estimate> runtime_estimates() const
+	{
+		return m_runtimes.snapshot();
 	}
 
 #ifndef DISABLE_CONTINUATIONS
@@ -178,18 +669,24 @@ public:
 		//Get hold of the continuation handle to task_data and obtain the future
 		auto task_data_ptr = continuation.get_data_handle();
 		TaskFuture<ContRes> future = task_data_ptr->promise.get_future();
+		auto state_ptr = task._Base::m_state_ptr;
 
 		//Set the continuation argument (eg. task);
 		std::get<0>(task_data_ptr->arguments) =  std::move(task) ;
 
-		//Set continuation in the task future 
-		task._Base::m_state_ptr->set_continuation(
-			std::make_unique<TaskExe<ContRes, TaskFuture<Res2>>>
-			(std::move(task_data_ptr), p));
+		//Add the continuation to the task future 
+		auto exe = std::make_unique<TaskExe<ContRes, TaskFuture<Res2>>>
+			(std::move(task_data_ptr), p);
+		link_producer(*exe, future, p, state_ptr);
 
 		//Set the executor_base in the future, so .then() can be implemented
 		future.set_executor_base(this);
 
+		state_ptr->add_continuation(std::move(exe));
+
+		//Whoever will wait on the continuation waits on the task as well
+		state_ptr->inherit_priority(p);
+
 		return future;
 	}
 
@@ -228,31 +725,507 @@ public:
 
 	//Unpack the future automatically if the task does not take a future as param
 
+	//Shared futures can have any number of continuations. Each one gets its
+	//own copy of the SharedTaskFuture, the value itself is never copied
+	template <class ContRes, class Res2>
+	TaskFuture<ContRes> schedule_continuation(const SharedTaskFuture<Res2>& task,
+		Task<ContRes(SharedTaskFuture<Res2>)>&& continuation,
+		Priority p = MEDIUM)
+	{
+		auto task_data_ptr = continuation.get_data_handle();
+		TaskFuture<ContRes> future = task_data_ptr->promise.get_future();
+
+		std::get<0>(task_data_ptr->arguments) = task;
+
+		auto exe = std::make_unique<TaskExe<ContRes, SharedTaskFuture<Res2>>>
+			(std::move(task_data_ptr), p);
+		link_producer(*exe, future, p, task._Base::m_state_ptr);
+		future.set_executor_base(this);
+
+		task._Base::m_state_ptr->add_continuation(std::move(exe));
+		task._Base::m_state_ptr->inherit_priority(p);
+
+		return future;
+	}
+
+	//Accepts either fn(SharedTaskFuture<Res>) or fn(const Res&) (fn() for void)
+	template <class Res, class Fn>
+	decltype(auto) schedule_continuation(const SharedTaskFuture<Res>& task, Fn&& fn, Priority p = MEDIUM)
+	{
+		return schedule_continuation(task, 
+			make_shared_continuation<Res>(std::forward<Fn>(fn)), p);
+	}
+
+private:
+	template <class Res, class Fn>
+	static auto make_shared_continuation(Fn&& fn)
+	{
+		using Future = SharedTaskFuture<Res>;
+		using FnType = std::decay_t<Fn>;
+
+		if constexpr (std::is_invocable<FnType&, Future>::value)
+			return Task<std::invoke_result_t<FnType&, Future>(Future)>(
+				std::forward<Fn>(fn));
+		else if constexpr (std::is_void<Res>::value)
+			return Task<std::invoke_result_t<FnType&>(Future)>(
+				[fn = std::forward<Fn>(fn)](Future f) mutable { f.get(); return fn(); });
+		else
+			return Task<std::invoke_result_t<FnType&, const Res&>(Future)>(
+				[fn = std::forward<Fn>(fn)](Future f) mutable { return fn(f.get()); });
+	}
+#endif
+
 private:
 	template<class T> friend class shared_state_base;
 	
-	void m_schedule_continuation(std::unique_ptr<Executable> executable)
+	//Enqueues a whole list of continuations with a single wake up pass
+	void m_schedule_continuations(Executable* list, tenant_id tenant = no_tenant)
 	{
-		m_queue.enqueue(std::move(executable));
+		size_t count = 0;
+		m_queue.enqueue_list(list, [this, &count, tenant](Executable* node) 
+		{
+			++count;
+			Executable* next = node->m_next;
+			node->m_next = nullptr;
+			stamp(*node, tenant);
+
+			//Under the queue lock: a boost either happened already or will
+			//find the task in the queue
+			if (node->m_result != nullptr)
+				node->m_priority = std::max(node->m_priority, node->m_result->inherited_priority());
+			return next;
+		});
+
+		if (m_wake_listener != nullptr)
+		{
+			m_wake_listener->task_queued(count > 1);
+			return;
+		}
+
+		{ std::lock_guard<std::mutex> lk(m_mutex); }
+		if (count == 1)
+			m_cv.notify_one();
+		else
+			m_cv.notify_all();
 	}
-#endif
 
 protected:
+	//Executors whose queue is drained by threads they don't own (see
+	//LanedExecutorPool) forward their wake ups to whoever owns the threads
+	class wake_listener
+	{
+	public:
+		virtual void task_queued(bool many) = 0;
+
+	protected:
+		~wake_listener() {}
+	};
+
+	void forward_wake_ups(wake_listener* listener)
+	{
+		m_wake_listener = listener;
+	}
+
 	void notify_threads()
 	{
 		//Wake up all the threads, so they can be terminated
 		m_cv.notify_all();
 	}
 
+	void notify_one_thread()
+	{
+		if (m_wake_listener != nullptr)
+		{
+			m_wake_listener->task_queued(m_restricted);
+			return;
+		}
+
+		//Taking the mutex orders the notification after a sleeper's
+		//empty() check, otherwise the wake up could get lost
+		{ std::lock_guard<std::mutex> lk(m_mutex); }
+
+		//With resource classes the woken thread may not be allowed
+		//to run the new task, so everyone has to take a look
+		if (m_restricted)
+			m_cv.notify_all();
+		else
+			m_cv.notify_one();
+	}
+
+	//Runs the highest priority queued task, if any, on the calling thread
+	bool try_run_one()
+	{
+		std::unique_ptr<Executable> task = dequeue_one();
+		if (!task)
+			return false;
+
+		run_dequeued(std::move(task));
+		return true;
+	}
+
+	//try_run_one in two steps, for executors deciding themselves when the
+	//task taken off the queue runs. nullptr if nothing may run
+	std::unique_ptr<Executable> dequeue_one()
+	{
+		std::unique_ptr<Executable> task;
+		std::lock_guard<std::mutex> lk(m_mutex);
+		next_task(task, no_worker);
+		return task;
+	}
+
+	void run_dequeued(std::unique_ptr<Executable> task)
+	{
+		using clock = std::chrono::steady_clock;
+		bool timed = m_cost_mode != cost_mode::off;
+		auto start = timed ? clock::now() : clock::time_point{};
+
+		Priority p = task->priority();
+		Priority outer = running_priority();
+		running_priority() = p;
+		task->execute();
+		running_priority() = outer;
+
+		if (timed)
+			m_runtimes.record(task->type(), clock::now() - start);
+		task_finished(p);
+	}
+
+	//Sleeps until a task is queued or the deadline expires
+	template <class Clock, class Duration>
+	bool wait_for_task_until(const std::chrono::time_point<Clock, Duration>& deadline)
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		return m_cv.wait_until(lk, deadline, [this] { return !m_queue.empty(); });
+	}
+
+public:
+	~Executor_base()
+	{
+		disable_watchdog();
+	}
+
+	//Starts a thread that reports, through callback, every task running for
+	//longer than budget and a pool that made no progress for that long while
+	//tasks are queued. Timing is done by sampling every poll interval
+	template <class Rep, class Period>
+	void enable_watchdog(const std::chrono::duration<Rep, Period>& budget,
+		std::function<void(const stall_report&)> callback)
+	{
+		disable_watchdog();
+		m_watchdog_alive = true;
+		m_watchdog_on.store(true, std::memory_order_relaxed);
+		m_watchdog = std::thread(&Executor_base::watchdog_run, this,
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(budget),
+			std::move(callback));
+	}
+
+	void disable_watchdog()
+	{
+		if (!m_watchdog.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lk(m_watchdog_mutex);
+			m_watchdog_alive = false;
+		}
+		m_watchdog_cv.notify_all();
+		m_watchdog.join();
+		m_watchdog_on.store(false, std::memory_order_relaxed);
+	}
+
+	size_t worker_count() const { return m_worker_count; }
+
+	//e.g. to merge worker-local accumulators. Only safe while the workers
+	//are not running tasks that touch the same state
+	WorkerContext& worker_context(size_t worker) { return *m_contexts.at(worker); }
+
+	//Resource classes reserve capacity, where Priority only orders the queue.
+	//At most max_concurrency tasks with a priority in [low, high] run at once;
+	//the ones over the limit stay queued and workers move on to other tasks.
+	//Configure before scheduling: classes must not overlap
+	void add_resource_class(Priority low, Priority high, size_t max_concurrency)
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+		m_classes.push_back({ max_concurrency, 0 });
+		for (unsigned p = low; p <= high; ++p)
+			m_class_of[p] = static_cast<unsigned char>(m_classes.size() - 1);
+		m_restricted = true;
+	}
+
+	//Workers [0, count) only pick tasks with priority >= min_priority, so
+	//long running low priority work can never occupy all of them
+	void reserve_workers(size_t count, Priority min_priority = HIGH)
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+		m_reserved_workers = count;
+		m_reserved_min_priority = min_priority;
+		m_restricted = true;
+	}
+
 protected:
 	//std::threads will run this function
-	static void run(Executor_base* owner, std::atomic_bool& alive);
+	static void run(Executor_base* owner, std::atomic_bool& alive, size_t worker);
+
+	//Derived classes call this before starting their threads
+	void set_worker_count(size_t count)
+	{
+		m_activity.reset(new worker_activity[count]);
+		m_worker_count = count;
+
+		m_contexts.clear();
+		for (size_t x = 0; x < count; ++x)
+			m_contexts.emplace_back(new WorkerContext(x));
+	}
+
+	static constexpr size_t no_worker = static_cast<size_t>(-1);
+
+	static Priority& running_priority()
+	{
+		static thread_local Priority p = LAST_TO_EXECUTE;
+		return p;
+	}
+
+public:
+	//Priority of the task running on the calling thread, LAST_TO_EXECUTE
+	//outside of tasks. Blocking on a future lends it to the future's task
+	static Priority current_priority() { return running_priority(); }
+
+private:
+	friend class priority_node;
+	friend class TaskGroup;
+
+	//Lets whoever waits on future find (and boost) exe
+	template <class Res>
+	void link_producer(Executable& exe, const TaskFuture_Base<Res>& future, Priority p,
+		std::shared_ptr<priority_node> antecedent = nullptr)
+	{
+		priority_node& node = *future.m_state_ptr;
+		node.m_executor = this;
+		node.m_priority.store(p, std::memory_order_relaxed);
+		node.m_antecedent = antecedent;
+		exe.m_result = &node;
+	}
+
+	//Raises the queued task fulfilling node. Returns false if it is not
+	//queued (running, done, or a continuation still parked)
+	bool boost_queued(const priority_node* node, Priority p)
+	{
+		bool found = m_queue.update_if(
+			[node](const std::unique_ptr<Executable>& t) { return t->m_result == node; },
+			[p](std::unique_ptr<Executable>& t) { t->m_priority = std::max(t->m_priority, p); });
+
+		//It may have become eligible for reserved workers or another class
+		if (found && m_restricted)
+			notify_one_thread();
+		return found;
+	}
+
+	struct resource_class
+	{
+		size_t max_concurrency;
+		size_t running;
+	};
+
+	static constexpr unsigned char no_class = 0xFF;
+
+	bool may_run(const Executable& task, size_t worker) const
+	{
+		if (worker < m_reserved_workers && task.priority() < m_reserved_min_priority)
+			return false;
+
+		auto c = m_class_of[task.priority()];
+		return c == no_class || m_classes[c].running < m_classes[c].max_concurrency;
+	}
+
+	//Picks up to m_max_batch tasks of the same priority that this worker
+	//may run now, highest priority first. m_mutex must be held
+	bool next_tasks(std::vector<std::unique_ptr<Executable>>& tasks, size_t worker)
+	{
+		if (m_max_batch == 1)
+		{
+			tasks.resize(1);
+			return next_task(tasks[0], worker);
+		}
+
+		tasks.clear();
+		bool budgeted = m_cost_mode != cost_mode::off;
+		std::chrono::nanoseconds expected{};
+		auto eligible = [&](const std::unique_ptr<Executable>& t) 
+		{
+			if (m_restricted && !may_run(*t, worker))
+				return false;
+
+			//The first task is always taken, the batch ends once the
+			//budget is spent (tasks of a batch share a priority, so the
+			//class and reservation checks also fail for the rest of it)
+			if (budgeted)
+			{
+				if (expected >= m_batch_budget)
+					return false;
+				expected += m_runtimes.estimate(t->type());
+			}
+
+			//Count it right away, the limit applies within the batch too
+			if (m_restricted && m_class_of[t->priority()] != no_class)
+				++m_classes[m_class_of[t->priority()]].running;
+			return true;
+		};
+		m_queue.try_dequeue_batch(tasks, m_max_batch, eligible);
+
+		if (m_fair)
+			for (auto&& task : tasks)
+				dispatched(*task);
+		return !tasks.empty();
+	}
+
+	//Picks the highest priority task this worker may run now. 
+	//m_mutex must be held
+	bool next_task(std::unique_ptr<Executable>& task, size_t worker)
+	{
+		bool found;
+		if (!m_restricted)
+			found = m_queue.try_dequeue(task);
+		else
+		{
+			found = m_queue.try_dequeue_if(task,
+				[&](const std::unique_ptr<Executable>& t) { return may_run(*t, worker); });
+
+			if (found && m_class_of[task->priority()] != no_class)
+				++m_classes[m_class_of[task->priority()]].running;
+		}
+
+		if (found && m_fair)
+			dispatched(*task);
+		return found;
+	}
+
+	//Weighted fair queuing (start-time fair queuing flavour). A tenant's
+	//next task finishes 1/weight after its previous one, but never before
+	//the virtual time, so an idle tenant doesn't hoard credit. Tasks of no
+	//tenant are stamped with the virtual time itself
+	static constexpr std::uint64_t fair_unit = 1 << 20;
+
+	//With shortest_first tags are expected runtimes in ns. A tenant's task
+	//costs at least this much, unmeasured types included, so a flood of
+	//cheap or new tasks still moves the tenant's finish time forward
+	static constexpr std::uint64_t min_fair_cost = fair_unit / 1024;
+
+	struct alignas(64) tenant_state
+	{
+		explicit tenant_state(unsigned w) : weight(w) {}
+
+		const unsigned weight;
+		std::mutex mutex;
+		std::uint64_t last_finish = 0;
+		std::atomic<size_t> queued{ 0 };
+		std::atomic<std::uint64_t> started{ 0 };
+	};
+
+	void stamp(Executable& exe, tenant_id tenant)
+	{
+		bool sjf = m_cost_mode == cost_mode::shortest_first;
+		if (!m_fair && !sjf)
+			return;
+
+		//Unknown types count as free: they run early and get measured
+		std::uint64_t cost = sjf ? static_cast<std::uint64_t>(m_runtimes.estimate(exe.type()).count()) : 0;
+		if (!m_fair)
+		{
+			exe.m_tag = cost;
+			return;
+		}
+
+		auto now = m_virtual_time.load(std::memory_order_relaxed);
+		if (tenant == no_tenant)
+		{
+			exe.m_tag = now + cost;
+			return;
+		}
+
+		tenant_state& t = *m_tenants.at(tenant);
+		{
+			std::lock_guard<std::mutex> lk(t.mutex);
+			std::uint64_t share = (sjf ? std::max(cost, min_fair_cost) : fair_unit) / t.weight;
+			t.last_finish = std::max(t.last_finish, now) + std::max<std::uint64_t>(share, 1);
+			exe.m_tag = t.last_finish;
+		}
+		exe.m_tenant = tenant;
+		if (exe.m_result != nullptr)
+			exe.m_result->m_tenant = tenant;
+		t.queued.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	//m_mutex must be held
+	void dispatched(const Executable& exe)
+	{
+		if (exe.m_tag > m_virtual_time.load(std::memory_order_relaxed))
+			m_virtual_time.store(exe.m_tag, std::memory_order_relaxed);
+
+		if (exe.m_tenant != no_tenant)
+		{
+			tenant_state& t = *m_tenants[exe.m_tenant];
+			t.queued.fetch_sub(1, std::memory_order_relaxed);
+			t.started.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	void task_finished(Priority p)
+	{
+		auto c = m_class_of[p];
+		if (c == no_class)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			--m_classes[c].running;
+		}
+
+		//Tasks held back by the limit may be runnable now
+		if (m_wake_listener != nullptr)
+			m_wake_listener->task_queued(true);
+		else
+			m_cv.notify_all();
+	}
 
 private:
 	concurrent_priority_queue<std::unique_ptr<Executable>> m_queue;
 	std::mutex m_mutex;
 	std::condition_variable m_cv;
-	 
+
+	//Resource classes, guarded by m_mutex
+	std::vector<resource_class> m_classes;
+	unsigned char m_class_of[256]; //Priority -> index in m_classes
+	size_t m_reserved_workers = 0;
+	Priority m_reserved_min_priority = HIGH;
+	bool m_restricted = false;
+
+	wake_listener* m_wake_listener = nullptr;
+
+	std::atomic<size_t> m_max_batch{ 1 };
+	std::chrono::nanoseconds m_batch_budget = std::chrono::microseconds(100);
+
+	//Runtime history, see set_cost_mode
+	static constexpr std::chrono::nanoseconds::rep loop_step = 64;
+	cost_mode m_cost_mode = cost_mode::off;
+	runtime_history m_runtimes;
+
+	//Tenants, see add_tenant. Only read once scheduling started
+	std::vector<std::unique_ptr<tenant_state>> m_tenants;
+	std::atomic<std::uint64_t> m_virtual_time{ 0 };
+	bool m_fair = false;
+
+	//Watchdog
+	void watchdog_run(std::chrono::steady_clock::duration budget,
+		std::function<void(const stall_report&)> callback);
+
+	std::unique_ptr<worker_activity[]> m_activity;
+	std::vector<std::unique_ptr<WorkerContext>> m_contexts;
+	size_t m_worker_count = 0;
+	std::thread m_watchdog;
+	std::mutex m_watchdog_mutex;
+	std::condition_variable m_watchdog_cv;
+	bool m_watchdog_alive = false;
+	std::atomic_bool m_watchdog_on{ false }; //workers publish their activity
 };
 
 class TaskExecutor : public Executor_base
@@ -260,8 +1233,10 @@ class TaskExecutor : public Executor_base
 public:
 	TaskExecutor()
 	{
+		_Base::set_worker_count(1);
+
 		//Pass a ref to thread as the constructor performs a copy
-		m_executor = std::thread(_Base::run, this, std::ref(m_alive));
+		m_executor = std::thread(_Base::run, this, std::ref(m_alive), 0);
 	}
 
 	~TaskExecutor()
@@ -278,6 +1253,50 @@ private:
 };
 
 
+//Executor that owns no thread. Queued tasks (continuations included) only
+//run when the owner calls one of the run_* functions, on the calling thread.
+//NOTE: a task must not block on a future that only this executor can fulfill
+class InlineExecutor : public Executor_base
+{
+public:
+	//Runs at most one task. Returns false if there was nothing to run
+	bool run_one()
+	{
+		return _Base::try_run_one();
+	}
+
+	//Runs tasks, sleeping while the queue is empty, until dur has elapsed.
+	//Returns the number of tasks executed
+	template <class Rep, class Period>
+	size_t run_for(const std::chrono::duration<Rep, Period>& dur)
+	{
+		auto end_time = std::chrono::steady_clock::now() + dur;
+		size_t count = 0;
+
+		while (std::chrono::steady_clock::now() < end_time)
+		{
+			if (_Base::try_run_one())
+				++count;
+			else if (!_Base::wait_for_task_until(end_time))
+				break;
+		}
+		return count;
+	}
+
+	//Runs until the queue is empty, including the tasks scheduled meanwhile
+	size_t run_until_idle()
+	{
+		size_t count = 0;
+		while (_Base::try_run_one())
+			++count;
+		return count;
+	}
+
+private:
+	using _Base = Executor_base;
+};
+
+
 //TODO: Probably want the thread pool to shrink and grow dynamically.
 //Not supported yet though. a max size must be provided
 
@@ -287,11 +1306,13 @@ class TaskExecutorPool : public Executor_base
 public:
 	TaskExecutorPool() 
 	{
+		_Base::set_worker_count(MAX_SIZE);
+
 		for (auto x = 0u; x < MAX_SIZE; ++x)
 		{
 			m_alive_threads[x] = true;
 			m_executor_pool[x] = std::thread(
-				_Base::run, this, std::ref(m_alive_threads[x]));
+				_Base::run, this, std::ref(m_alive_threads[x]), x);
 		}
 	}
 
@@ -314,25 +1335,141 @@ private:
 
 
 
-inline void Executor_base::run(Executor_base* owner, std::atomic_bool& alive)
+inline void Executor_base::run(Executor_base* owner, std::atomic_bool& alive, size_t worker)
 {
-	std::unique_ptr<Executable> task;
+	using clock = std::chrono::steady_clock;
+	std::vector<std::unique_ptr<Executable>> tasks;
+	worker_activity& activity = owner->m_activity[worker];
+	WorkerContext& context = *owner->m_contexts[worker];
+	WorkerContext::scope context_scope(context);
 
 	while (true)
 	{
-		//Put the thread to sleep while there are no tasks 
-		//to be executed. Thread is also woken on Executor distructor
+		//Put the thread to sleep while there are no tasks it may
+		//execute. Thread is also woken on Executor distructor
 		{
 			std::unique_lock<std::mutex> lk(owner->m_mutex);
-			while (owner->m_queue.empty() && alive)
+
+			//Dequeue the tasks before unlocking. A batch taken while alive
+			//was cleared still runs: its promises and class counts are ours
+			bool dequeued = false;
+			while (alive && !(dequeued = owner->next_tasks(tasks, worker)))
+			{
+				activity.idle();
 				owner->m_cv.wait(lk);
+			}
 
-			if (!alive) break;
+			if (!dequeued) break;
+		}
+
+		//Back to back tasks share a clock read, the end of one is the start
+		//of the next
+		bool timed = owner->m_cost_mode != cost_mode::off;
+		auto last = timed ? clock::now() : clock::time_point{};
+		bool watched = owner->m_watchdog_on.load(std::memory_order_relaxed);
+
+		for (auto&& task : tasks)
+		{
+			Priority p = task->priority();
+			const std::type_info& type = task->type();
+			if (watched)
+				activity.begin(*task);
+			else
+				activity.unwatched();
+			running_priority() = p;
+			task->execute();
+			task.reset();
+			context.task_finished();
+			owner->task_finished(p);
 
-			//Dequeue the task before unlocking
-			task = owner->m_queue.dequeue();
+			if (timed)
+			{
+				auto now = clock::now();
+				owner->m_runtimes.record(type, now - last);
+				last = now;
+			}
 		}
+	}
+}
 
-		task->execute();
+inline void Executor_base::watchdog_run(std::chrono::steady_clock::duration budget,
+	std::function<void(const stall_report&)> callback)
+{
+	using clock = std::chrono::steady_clock;
+	struct sample
+	{
+		std::uint64_t state;
+		clock::time_point since;
+		bool reported;
+	};
+
+	std::vector<sample> samples(m_worker_count, sample{ 0, clock::now(), false });
+	clock::time_point last_progress = clock::now();
+	bool stall_reported = false;
+	std::vector<stall_report> reports;
+
+	//A tiny budget must not turn the watchdog into a busy loop
+	auto poll_interval = std::max<clock::duration>(budget / 4, std::chrono::milliseconds(1));
+
+	std::unique_lock<std::mutex> lk(m_watchdog_mutex);
+	while (!m_watchdog_cv.wait_for(lk, poll_interval, [this] { return !m_watchdog_alive; }))
+	{
+		auto now = clock::now();
+
+		for (size_t x = 0; x < m_worker_count; ++x)
+		{
+			auto state = m_activity[x].m_state.load(std::memory_order_relaxed);
+			auto& last = samples[x];
+
+			if (state != last.state)
+			{
+				last = sample{ state, now, false };
+				last_progress = now;
+				stall_reported = false;
+				continue;
+			}
+
+			if ((state & worker_activity::busy_bit) && !last.reported && now - last.since > budget)
+			{
+				last.reported = true;
+				reports.push_back(stall_report{ x, m_activity[x].m_type.load(std::memory_order_relaxed),
+					static_cast<Priority>(state & 0xFF), now - last.since, false });
+			}
+		}
+
+		if (!stall_reported && now - last_progress > budget && !m_queue.empty())
+		{
+			stall_reported = true;
+			reports.push_back(stall_report{ 0, nullptr, LAST_TO_EXECUTE, now - last_progress, true });
+		}
+
+		//Not under the lock, a slow callback may take its time
+		if (!reports.empty())
+		{
+			lk.unlock();
+			for (auto&& report : reports)
+				callback(report);
+			reports.clear();
+			lk.lock();
+		}
 	}
 }
+
+inline void priority_node::inherit_priority(Priority p)
+{
+	if (m_settled.load(std::memory_order_relaxed))
+		return;
+
+	auto current = m_priority.load(std::memory_order_relaxed);
+	do
+	{
+		if (p <= current)
+			return;
+	} while (!m_priority.compare_exchange_weak(current, p, std::memory_order_relaxed));
+
+	if (m_executor != nullptr)
+		m_executor->boost_queued(this, p);
+
+	if (auto antecedent = m_antecedent.lock())
+		antecedent->inherit_priority(p);
+}
@@ -3,6 +3,8 @@
 #include <memory>
 #include <mutex>
 #include <chrono>
+#include <atomic>
+#include <exception>
 
 
 #include "TaskExecutor.h"
@@ -11,7 +13,7 @@
 
 /// Common implementation for shared_state<T> and shared_state<void>
 template <class T>
-class shared_state_base
+class shared_state_base : public priority_node
 {
 public:
 	bool is_ready() const
@@ -21,6 +23,18 @@ public:
 	
 	void wait() noexcept
 	{
+		//The caller is about to block anyway, run a deferred task right here
+		kick_deferred(true);
+		lend_priority();
+
+#ifndef DISABLE_CONTINUATIONS
+		//On a fiber: park it, the continuation list makes it runnable again
+		if (!is_ready())
+			if (fiber_hook* fiber = fiber_hook::current())
+				fiber->suspend(Executor_base::current_priority(),
+					[this](std::unique_ptr<Executable> wake) { add_continuation(std::move(wake)); });
+#endif
+
 		std::unique_lock<std::mutex> lk(m_mutex);
 		while (!is_ready())
 			m_cv.wait(lk);
@@ -29,6 +43,8 @@ public:
 	template <class Rep, class Period>
 	bool wait_for (const std::chrono::duration<Rep, Period>& dur_time)
 	{
+		kick_deferred(false);
+		lend_priority();
 		std::unique_lock<std::mutex> lk(m_mutex);
 		return m_cv.wait_for(lk, dur_time, [&] {return m_is_ready; });
 	}
@@ -36,29 +52,116 @@ public:
 	template <class Rep, class Period>
 	bool wait_until(const std::chrono::duration<Rep, Period>& end_time)
 	{
+		kick_deferred(false);
+		lend_priority();
 		std::unique_lock<std::mutex> lk(m_mutex);
 		return m_cv.wait_until(lk, end_time, [&] {return m_is_ready; });
 	}
 
+#ifndef DISABLE_CONTINUATIONS
+	~shared_state_base()
+	{
+		//Continuations of a state that never became ready are never run
+		Executable* node = m_continuations.load(std::memory_order_acquire);
+		if (node == released_tag())
+			return;
+
+		while (node != nullptr)
+		{
+			Executable* next = node->m_next;
+			delete node;
+			node = next;
+		}
+	}
+#endif
+
+	//Deferred tasks (Executor_base::schedule_deferred) are parked here
+	//until somebody needs the result
+	bool has_deferred() const
+	{
+		return m_deferred.load(std::memory_order_relaxed) != nullptr;
+	}
+
+	void set_deferred(std::unique_ptr<Executable> exe)
+	{
+		m_deferred.store(exe.release(), std::memory_order_release);
+	}
+
+	//Enqueues the deferred task (or runs it on the calling thread). Only
+	//the first call does anything
+	void kick_deferred(bool run_inline)
+	{
+		if (!has_deferred())
+			return;
+
+		std::unique_ptr<Executable> exe(m_deferred.exchange(nullptr, std::memory_order_acq_rel));
+		if (exe == nullptr)
+			return;
+
+#ifndef DISABLE_CONTINUATIONS
+		if (!run_inline && m_task_executor_base != nullptr)
+		{
+			m_task_executor_base->m_schedule_continuations(exe.release());
+			return;
+		}
+#endif
+		exe->execute();
+	}
+
+	//The task is never run, its promise is released
+	void drop_deferred()
+	{
+		delete m_deferred.exchange(nullptr, std::memory_order_acq_rel);
+	}
+
+	//Live TaskFuture/SharedTaskFuture objects on this state. Once the last
+	//one is gone nobody can ask for a deferred task anymore: it is dropped
+	//rather than left to keep the state alive through its own promise
+	void future_attached()
+	{
+		m_futures.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void future_released()
+	{
+		if (m_futures.fetch_sub(1, std::memory_order_acq_rel) == 1 && has_deferred())
+			drop_deferred();
+	}
+
 protected:
 	void set_ready() noexcept
 	{
-		std::unique_lock<std::mutex> lk(m_mutex);
-		m_is_ready = true;
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			m_is_ready = true;
+		}
+		priority_node::settle();
 
 		//Wake up whoever is waiting for this future to become ready
 		m_cv.notify_all();
 
 #ifndef DISABLE_CONTINUATIONS
-		if (m_continuation != nullptr)
-			m_task_executor_base->
-			    m_schedule_continuation(std::move(m_continuation));
+		//Detach the whole list at once. Continuations added from now on
+		//see the tag and are released immediately
+		Executable* list = m_continuations.exchange(released_tag(), 
+			std::memory_order_acq_rel);
+		if (list != nullptr)
+			release_continuations(list);
 #endif
 	}
 
 private:
+	//A task blocking on us shouldn't wait for lower priority work
+	void lend_priority()
+	{
+		if (!is_ready())
+			priority_node::inherit_priority(Executor_base::current_priority());
+	}
+
 	std::mutex m_mutex;
 	std::condition_variable m_cv;
+	std::atomic<Executable*> m_deferred{ nullptr };
+	std::atomic<size_t> m_futures{ 0 };
 
 	//The following is required for continuations (*.then()*)
 #ifndef DISABLE_CONTINUATIONS
@@ -69,20 +172,87 @@ public:
 		return m_task_executor_base;
 	}
 
-	void set_continuation(std::unique_ptr<Executable> exe)
+	//Any number of continuations can be attached, they are all released
+	//in one pass by set_ready (or right away if the state is already ready)
+	void add_continuation(std::unique_ptr<Executable> exe)
 	{
-		m_continuation = std::move(exe);
+		Executable* node = exe.release();
+		Executable* head = m_continuations.load(std::memory_order_acquire);
+
+		do
+		{
+			if (head == released_tag())
+			{
+				node->m_next = nullptr;
+				release_continuations(node);
+				return;
+			}
+			node->m_next = head;
+		} while (!m_continuations.compare_exchange_weak(head, node,
+			std::memory_order_release, std::memory_order_acquire));
+
+		//Somebody wants the result now
+		kick_deferred(false);
 	}
 
 private:
-	using Continuation = std::unique_ptr<Executable>;
+	Executable* released_tag() const
+	{
+		//Any address that can't be a real Executable will do
+		return reinterpret_cast<Executable*>(
+			const_cast<std::atomic<Executable*>*>(&m_continuations));
+	}
 
-	Continuation m_continuation{nullptr};
+	void release_continuations(Executable* list) noexcept
+	{
+		//The list is LIFO, restore the order in which they were attached
+		Executable* ordered = nullptr;
+		while (list != nullptr)
+		{
+			Executable* next = list->m_next;
+			list->m_next = ordered;
+			ordered = list;
+			list = next;
+		}
+
+		if (m_task_executor_base != nullptr)
+		{
+			m_task_executor_base->m_schedule_continuations(ordered, priority_node::producer_tenant());
+			return;
+		}
+
+		//No executor to hand them to (e.g. a plain TaskPromise):
+		//run them on the thread that made the state ready
+		while (ordered != nullptr)
+		{
+			std::unique_ptr<Executable> exe(ordered);
+			ordered = ordered->m_next;
+			exe->execute();
+		}
+	}
+
+	//Intrusive stack linked through Executable::m_next
+	std::atomic<Executable*> m_continuations{ nullptr };
 	Executor_base* m_task_executor_base = nullptr;
 #endif
 
 protected:
+	//Set instead of a value by TaskPromise::set_exception, rethrown by get()
+	void set_error(std::exception_ptr error) noexcept
+	{
+		if (m_is_ready) return;
+		m_error = std::move(error);
+		set_ready();
+	}
+
+	void rethrow_error() const
+	{
+		if (m_error)
+			std::rethrow_exception(m_error);
+	}
+
 	bool m_is_ready = false;
+	std::exception_ptr m_error;
 };
 
 template <class T>
@@ -95,7 +265,7 @@ public:
 	~shared_state()
 	{
 		//call destructor explicitly after placement new
-		if (_Base::is_ready())
+		if (_Base::is_ready() && !_Base::m_error)
 			reinterpret_cast<T*>(&m_value)->~T();
 	}
 	bool already_retrieved() const { return m_is_retrieved; }
@@ -107,6 +277,7 @@ public:
 	T get_move_value_or_void()
 	{
 		_Base::wait();
+		_Base::rethrow_error();
 		m_is_retrieved = true;
 		return std::move(*reinterpret_cast<T*>(&m_value));
 	}
@@ -114,12 +285,14 @@ public:
 	T get_copy_value()
 	{
 		_Base::wait();
+		_Base::rethrow_error();
 		return (*reinterpret_cast<T*>(&m_value));
 	}
 
 	const T& get_const_ref_value_or_void()
 	{
 		_Base::wait();
+		_Base::rethrow_error();
 		return (*reinterpret_cast<T*>(&m_value));
 	}
 
@@ -155,15 +328,31 @@ public:
 	void get_move_value_or_void()
 	{
 		_Base::wait();
+		_Base::rethrow_error();
 	}
 
 	void get_const_ref_value_or_void()
 	{
 		_Base::wait();
+		_Base::rethrow_error();
 	}
 };
 
 
+template <class Res>
+class TaskFuture_Base;
+
+//Lets executors that don't derive from Executor_base (see PolicyExecutor.h)
+//attach continuations to a future's shared state
+struct future_state_access
+{
+	template <class Res>
+	static const std::shared_ptr<shared_state<Res>>& state(const TaskFuture_Base<Res>& future)
+	{
+		return future.m_state_ptr;
+	}
+};
+
 template <class Res>
 class TaskFuture_Base
 {
@@ -192,17 +381,50 @@ public:
 		return m_state_ptr->wait_until(end_time);
 	}
 
-protected:
+	//Queues a deferred task without waiting for it. No-op otherwise
+	void kick()
+	{
+		m_state_ptr->kick_deferred(false);
+	}
 
+	//Raises the task fulfilling this future (and its antecedents) to at
+	//least p. Waiting from inside a task does this implicitly
+	void boost(Priority p)
+	{
+		m_state_ptr->inherit_priority(p);
+	}
+
+protected:
+	~TaskFuture_Base()
+	{
+		release_state();
+	}
 
-	//template <class TSharedState>
+	//A new future on state
 	TaskFuture_Base(SharedState_ptr state) :
-		m_state_ptr(state) {}
+		m_state_ptr(std::move(state))
+	{
+		if (m_state_ptr)
+			m_state_ptr->future_attached();
+	}
+
+	//Takes over the place of a future that gave up state (moves)
+	struct adopt_t {};
+	TaskFuture_Base(SharedState_ptr&& state, adopt_t) :
+		m_state_ptr(std::move(state)) {}
+
+	void release_state()
+	{
+		if (m_state_ptr)
+			m_state_ptr->future_released();
+		m_state_ptr.reset();
+	}
 
 	//TaskFuture_Base(const SharedState_ptr& state) :
 	//	m_state_ptr(state) {}
 private:
 	friend class Executor_base;
+	friend struct future_state_access;
 
 	void set_executor_base(Executor_base* e)
 	{
@@ -225,17 +447,24 @@ public:
 	using _Base = TaskFuture_Base<Res>;
 	using Sharedstate_ptr = typename _Base::SharedState_ptr;
 
+	//Not attached to any state, like a default constructed std::shared_future
+	SharedTaskFuture() : _Base(nullptr) {}
+
 	SharedTaskFuture(const SharedTaskFuture& other_future) :
 		TaskFuture_Base(other_future._Base::m_state_ptr) {};
 
 	SharedTaskFuture (SharedTaskFuture&& other_future) :
-		TaskFuture_Base(std::move(other_future._Base::m_state_ptr)){}
+		TaskFuture_Base(std::move(other_future._Base::m_state_ptr), typename _Base::adopt_t{}) {}
 
 	SharedTaskFuture& operator=(const SharedTaskFuture& other)
 	{
 		if (this == &other)
 			return *this;
-		_Base::m_state_ptr = other._Base::m_state_ptr;
+		auto state = other._Base::m_state_ptr;
+		if (state)
+			state->future_attached();
+		_Base::release_state();
+		_Base::m_state_ptr = std::move(state);
 		return *this;
 	}
 
@@ -260,9 +489,21 @@ public:
 		return _Base::m_state_ptr->get_copy_value();
 	}
 
+	bool valid() const { return _Base::m_state_ptr != nullptr; }
+
+	//Can be called any number of times. fn takes either a SharedTaskFuture
+	//or a const reference to the value (nothing for void), never a copy
+	template <class TTask>
+	decltype(auto) then(TTask&& task, Priority p = MEDIUM) const
+	{
+		return _Base::m_state_ptr->executor_base()->schedule_continuation(
+			*this, std::forward<TTask>(task), p);
+	}
+
 private:
+	//From TaskFuture::share(), which gave up its place
 	explicit SharedTaskFuture(Sharedstate_ptr&& state) :
-		TaskFuture_Base(std::move(state)) {};
+		TaskFuture_Base(std::move(state), typename _Base::adopt_t{}) {};
 
 };
 
@@ -282,11 +523,18 @@ public:
 	TaskFuture& operator= (const TaskFuture&) = delete;
 
 	TaskFuture(TaskFuture&& other_future) : 
-		TaskFuture_Base(std::move(other_future._Base::m_state_ptr)) {}
+		TaskFuture_Base(std::move(other_future._Base::m_state_ptr), typename _Base::adopt_t{}) {}
 
+	//rhs stays attached (continuations rely on it), both count as live
 	TaskFuture& operator= (TaskFuture&& rhs) 
 	{
-		this->_Base::m_state_ptr =  rhs._Base::m_state_ptr;
+		if (this == &rhs)
+			return *this;
+		auto state = rhs._Base::m_state_ptr;
+		if (state)
+			state->future_attached();
+		_Base::release_state();
+		this->_Base::m_state_ptr = std::move(state);
 		
 		return *this;
 	}
@@ -341,6 +589,12 @@ public:
 		return;
 	}
 
+	//get() rethrows error instead of returning a value
+	void set_exception(std::exception_ptr error)
+	{
+		m_state->set_error(std::move(error));
+	}
+
 private:
 	using SharedState_ptr = std::shared_ptr<shared_state<Res>>;
 	SharedState_ptr m_state;
@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <utility>
+
+#include "Task.h"
+#include "TaskExecutor.h"
+
+///Fire many, then wait for all of them. Tasks run through the group get no
+///future (no shared state, mutex or condition variable each): a single
+///counter tracks them. The first exception cancels the rest of the group
+///and is rethrown by wait().
+///
+///	TaskGroup group(pool);
+///	for (auto& tile : tiles)
+///		group.run([&tile] { render(tile); });
+///	group.wait();
+class TaskGroup
+{
+public:
+	explicit TaskGroup(Executor_base& executor) : m_executor(executor) {}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator= (const TaskGroup&) = delete;
+
+	//Never leave tasks running that reference the group
+	~TaskGroup()
+	{
+		wait_idle();
+	}
+
+	template <class Fn>
+	void run(Fn&& fn, Priority p = MEDIUM)
+	{
+		m_pending.fetch_add(1, std::memory_order_relaxed);
+		try
+		{
+			m_executor.post(std::make_unique<group_task<std::decay_t<Fn>>>(
+				*this, std::forward<Fn>(fn), p));
+		}
+		catch (...)
+		{
+			//Never queued, wait() must not count on it
+			task_done();
+			throw;
+		}
+	}
+
+	//Runs queued tasks of the executor on the calling thread while the group
+	//is not done, then sleeps. Rethrows the first exception of a task.
+	//The group can be reused afterwards
+	void wait()
+	{
+		wait_idle();
+
+		m_cancelled.store(false, std::memory_order_relaxed);
+		if (m_exception)
+			std::rethrow_exception(std::exchange(m_exception, nullptr));
+	}
+
+	//Tasks that didn't start yet are skipped. Running ones can poll is_cancelled()
+	void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+	bool is_cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+
+private:
+	template <class Fn>
+	class group_task final : public Executable
+	{
+	public:
+		group_task(TaskGroup& group, Fn&& fn, Priority p) :
+			Executable(p, typeid(group_task)), m_group(group), m_fn(std::move(fn)) {}
+
+		group_task(TaskGroup& group, const Fn& fn, Priority p) :
+			Executable(p, typeid(group_task)), m_group(group), m_fn(fn) {}
+
+		void execute() override
+		{
+			if (!m_group.is_cancelled())
+			{
+				try
+				{
+					m_fn();
+				}
+				catch (...)
+				{
+					m_group.fail(std::current_exception());
+				}
+			}
+			m_group.task_done();
+		}
+
+	private:
+		TaskGroup& m_group;
+		Fn m_fn;
+	};
+
+	void fail(std::exception_ptr e)
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			if (!m_exception)
+				m_exception = e;
+		}
+		cancel();
+	}
+
+	void task_done()
+	{
+		//Cheap while other tasks are pending
+		size_t pending = m_pending.load(std::memory_order_relaxed);
+		while (pending > 1)
+			if (m_pending.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel))
+				return;
+
+		//Possibly the last one: decrement and notify under the lock, so the
+		//waiter can't see zero and destroy the group before the notify is done
+		std::lock_guard<std::mutex> lk(m_mutex);
+		if (m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			m_cv.notify_all();
+	}
+
+	void wait_idle()
+	{
+		while (m_pending.load(std::memory_order_acquire) != 0)
+		{
+			//Helping may run tasks of other groups too, like any worker would
+			if (!m_executor.try_run_one())
+				break;
+		}
+
+		//Zero is only final once observed under the lock: the last task
+		//may still be about to notify
+		std::unique_lock<std::mutex> lk(m_mutex);
+		m_cv.wait(lk, [this] { return m_pending.load(std::memory_order_acquire) == 0; });
+	}
+
+	Executor_base& m_executor;
+	std::atomic<size_t> m_pending{ 0 };
+	std::atomic_bool m_cancelled{ false };
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::exception_ptr m_exception;
+};
@@ -0,0 +1,118 @@
+#pragma once
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+///One thread sleeping until the earliest deadline and running the due
+///callbacks. Callbacks run on the timer thread, so they should be short:
+///typically they just schedule a task on some executor.
+class TimerQueue
+{
+public:
+	using clock = std::chrono::steady_clock;
+	using timer_id = std::uint64_t;
+
+	TimerQueue() : m_thread(&TimerQueue::run, this) {}
+
+	~TimerQueue()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_alive = false;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+	TimerQueue(const TimerQueue&) = delete;
+	TimerQueue& operator= (const TimerQueue&) = delete;
+
+	//Shared by everything that doesn't need a dedicated timer thread
+	static TimerQueue& global()
+	{
+		static TimerQueue timer;
+		return timer;
+	}
+
+	timer_id call_at(clock::time_point deadline, std::function<void()> fn)
+	{
+		bool earliest;
+		timer_id id;
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			id = ++m_last_id;
+			m_timers.emplace(std::make_pair(deadline, id), std::move(fn));
+			m_deadlines.emplace(id, deadline);
+			earliest = m_timers.begin()->first.second == id;
+		}
+
+		//Only the new earliest deadline changes how long the thread sleeps
+		if (earliest)
+			m_cv.notify_one();
+		return id;
+	}
+
+	template <class Rep, class Period>
+	timer_id call_after(const std::chrono::duration<Rep, Period>& delay, std::function<void()> fn)
+	{
+		return call_at(clock::now() + delay, std::move(fn));
+	}
+
+	//Returns false if the callback already ran (or is running)
+	bool cancel(timer_id id)
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+		auto it = m_deadlines.find(id);
+		if (it == m_deadlines.end())
+			return false;
+
+		m_timers.erase(std::make_pair(it->second, id));
+		m_deadlines.erase(it);
+		return true;
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		while (m_alive)
+		{
+			if (m_timers.empty())
+			{
+				m_cv.wait(lk);
+				continue;
+			}
+
+			auto first = m_timers.begin();
+			if (clock::now() < first->first.first)
+			{
+				m_cv.wait_until(lk, first->first.first);
+				continue;
+			}
+
+			auto fn = std::move(first->second);
+			m_deadlines.erase(first->first.second);
+			m_timers.erase(first);
+
+			lk.unlock();
+			fn();
+			lk.lock();
+		}
+	}
+
+	//Ordered by deadline, ties broken by creation order
+	std::map<std::pair<clock::time_point, timer_id>, std::function<void()>> m_timers;
+	std::unordered_map<timer_id, clock::time_point> m_deadlines;
+	timer_id m_last_id = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_alive = true;
+	std::thread m_thread;
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+///Per worker state, reachable from inside a running task through
+///WorkerContext::current(): the worker index, a scratch bump arena that is
+///reset after every task, and typed worker-local slots. Each context is
+///only touched by its own worker, and sits on its own cache line.
+///
+///	auto* ctx = WorkerContext::current();
+///	float* tmp = ctx->allocate_array<float>(n);  //gone when the task returns
+///	ctx->local<histogram>().add(x);              //one histogram per worker
+class alignas(64) WorkerContext
+{
+public:
+	explicit WorkerContext(size_t index, size_t arena_block = 64 * 1024) :
+		m_index(index), m_block_size(arena_block) {}
+
+	WorkerContext(const WorkerContext&) = delete;
+	WorkerContext& operator= (const WorkerContext&) = delete;
+
+	//nullptr when the calling thread is not running a worker's task
+	static WorkerContext* current() { return current_slot(); }
+
+	size_t index() const { return m_index; }
+
+	//Scratch memory, valid until the task returns or reset_arena().
+	//Nothing is destroyed: only meant for trivially destructible data
+	void* allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+	{
+		while (true)
+		{
+			if (m_block < m_blocks.size())
+			{
+				block& b = m_blocks[m_block];
+				auto base = reinterpret_cast<std::uintptr_t>(b.data.get());
+				auto first = (base + m_offset + align - 1) & ~(std::uintptr_t(align) - 1);
+				if (first + bytes <= base + b.size)
+				{
+					m_offset = first + bytes - base;
+					return reinterpret_cast<void*>(first);
+				}
+				++m_block;
+				m_offset = 0;
+				continue;
+			}
+
+			//Blocks are kept across resets, so this only happens while warming up
+			size_t size = std::max(m_block_size, bytes + align);
+			m_blocks.push_back(block{ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+		}
+	}
+
+	template <class T>
+	T* allocate_array(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value,
+			"the arena never runs destructors");
+		return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	void reset_arena()
+	{
+		m_block = 0;
+		m_offset = 0;
+	}
+
+	//One T per worker, default constructed on first use and destroyed
+	//with the context (i.e. with the pool)
+	template <class T>
+	T& local()
+	{
+		size_t id = slot_id<T>();
+		if (id >= m_slots.size())
+			m_slots.resize(id + 1);
+
+		auto& slot = m_slots[id];
+		if (!slot)
+			slot = slot_ptr(new T(), slot_deleter{ [](void* p) { delete static_cast<T*>(p); } });
+		return *static_cast<T*>(slot.get());
+	}
+
+	//Makes ctx the current context of the calling thread while alive
+	class scope
+	{
+	public:
+		explicit scope(WorkerContext& ctx) : m_previous(current_slot())
+		{
+			current_slot() = &ctx;
+		}
+		~scope() { current_slot() = m_previous; }
+
+		scope(const scope&) = delete;
+		scope& operator= (const scope&) = delete;
+
+	private:
+		WorkerContext* m_previous;
+	};
+
+	//Called by the worker between tasks
+	void task_finished()
+	{
+		if (m_block != 0 || m_offset != 0)
+			reset_arena();
+	}
+
+private:
+	static WorkerContext*& current_slot()
+	{
+		static thread_local WorkerContext* ctx = nullptr;
+		return ctx;
+	}
+
+	//Dense ids, so a slot lookup is a vector index
+	template <class T>
+	static size_t slot_id()
+	{
+		static const size_t id = next_slot_id()++;
+		return id;
+	}
+
+	static std::atomic<size_t>& next_slot_id()
+	{
+		static std::atomic<size_t> next{ 0 };
+		return next;
+	}
+
+	struct block
+	{
+		std::unique_ptr<unsigned char[]> data;
+		size_t size;
+	};
+
+	struct slot_deleter
+	{
+		void(*destroy)(void*) = nullptr;
+		void operator()(void* p) const { destroy(p); }
+	};
+	using slot_ptr = std::unique_ptr<void, slot_deleter>;
+
+	size_t m_index;
+	size_t m_block_size;
+	std::vector<block> m_blocks;
+	size_t m_block = 0;  //block being bumped
+	size_t m_offset = 0; //within that block
+	std::vector<slot_ptr> m_slots;
+};
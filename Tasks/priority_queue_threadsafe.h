@@ -2,6 +2,10 @@
 #include <vector>
 #include <queue>
 #include <mutex>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <iterator>
 template <class T, class Container = std::vector<T>>
 class atomic_priority_queue
 {
@@ -44,6 +48,72 @@ public:
 		return res;
 	}
 
+	//Non-blocking dequeue. Returns false if the queue was empty
+	bool try_dequeue(T& value)
+	{
+		lock lk(m_mutex);
+		if (m_queue.empty()) return false;
+
+		value = std::move(m_queue.front());
+		m_queue.pop_front();
+
+		return true;
+	}
+
+	//Dequeues the first (highest priority) element satisfying pred
+	template <class Pred>
+	bool try_dequeue_if(T& value, Pred pred)
+	{
+		lock lk(m_mutex);
+		auto it = std::find_if(m_queue.begin(), m_queue.end(), pred);
+		if (it == m_queue.end()) return false;
+
+		value = std::move(*it);
+		m_queue.erase(it);
+
+		return true;
+	}
+
+	//Moves out up to max elements that compare equal to the first element
+	//satisfying pred, keeping their order. Stops at the first of them that
+	//doesn't satisfy pred, so pred can end the batch (e.g. a budget)
+	template <class Out, class Pred>
+	void try_dequeue_batch(Out& out, size_t max, Pred pred)
+	{
+		lock lk(m_mutex);
+		auto first = std::find_if(m_queue.begin(), m_queue.end(), pred);
+		if (first == m_queue.end()) return;
+
+		out.push_back(std::move(*first));
+
+		//out.front() is the first one taken, compare against it
+		auto last = std::next(first);
+		while (out.size() < max && last != m_queue.end()
+			&& !(*last < out.front()) && !(out.front() < *last) && pred(*last))
+		{
+			out.push_back(std::move(*last));
+			++last;
+		}
+		m_queue.erase(first, last);
+	}
+
+	//Applies update to the first element satisfying pred and moves it to
+	//its new place (update may only change its priority)
+	template <class Pred, class Update>
+	bool update_if(Pred pred, Update update)
+	{
+		lock lk(m_mutex);
+		auto it = std::find_if(m_queue.begin(), m_queue.end(), pred);
+		if (it == m_queue.end()) return false;
+
+		T value = std::move(*it);
+		m_queue.erase(it);
+		update(value);
+		insert_sorted(std::move(value));
+
+		return true;
+	}
+
 	void enqueue(const T& value)
 	{
 		lock lk(m_mutex);
@@ -53,8 +123,21 @@ public:
 	void enqueue(T&& value)
 	{
 		lock lk(m_mutex);
-		m_queue.push_back(std::move(value));
-		std::stable_sort(m_queue.begin(), m_queue.end(), std::greater<>());
+		insert_sorted(std::move(value));
+	}
+
+	//Takes ownership of an intrusive list of raw pointers under a single
+	//lock. next(node) unlinks node and returns the one after it
+	template <class Node, class Next>
+	void enqueue_list(Node* head, Next next)
+	{
+		lock lk(m_mutex);
+		while (head != nullptr)
+		{
+			Node* node = head;
+			head = next(node);
+			insert_sorted(T(node));
+		}
 	}
 
 	size_type size()
@@ -68,6 +151,15 @@ public:
 		return size() == 0;
 	}
 private:
+	//Keeps the deque sorted (highest first). Inserting after the equal
+	//elements preserves FIFO order within the same priority
+	void insert_sorted(T&& value)
+	{
+		auto pos = std::upper_bound(m_queue.begin(), m_queue.end(), value, 
+			std::greater<>());
+		m_queue.insert(pos, std::move(value));
+	}
+
 	using lock = std::lock_guard<std::mutex>;
 	std::deque<T> m_queue;
 	std::mutex m_mutex;